@@ -16,8 +16,8 @@
 
 /* Extern variables ---------------------------------------------------------*/
 // constants
-const int kMaxStep = 3000; // max step number for one rollout
-const int kMaxState = 160; // max (state dimension, actuator number)
+const int kMaxState = 160; // max (state dimension, actuator number) of the per-step scratch vectors
+const size_t kAlign = 64;  // alignment of the problem storage, one cache line
 
 // model parameters and environment settings
 int integration_per_step = 1;
@@ -26,23 +26,108 @@ int actuatornum;
 int quatnum;
 int dof;
 int nodenum;
+int statedim;              // 2*dof+quatnum
 int modelid;
 int rolloutnum_train;
 mjtNum control_timestep;
 mjtNum simulation_timestep;
 mjtNum ctrl_upperlimit = 100;
 mjtNum ctrl_lowerlimit = -100;
-mjtNum state_nominal[kMaxStep][kMaxState] = { 0 };
-mjtNum ctrl_nominal[kMaxStep * kMaxState] = { 0 }; 
-mjtNum ctrl_openloop[kMaxStep*kMaxState] = { 0 };
-mjtNum rest_length[kMaxStep * kMaxState] = { 0 };
-mjtNum delta_rest_length[kMaxStep*kMaxState] = { 0 };
-mjtNum state_target[kMaxState] = { 0 };
-mjtNum stabilizer_feedback_gain[kMaxState][kMaxState] = { 0 };
+// problem storage, allocated by modelDimension for the loaded model and stepnum
+AlignedMatrix state_nominal;                // (stepnum+1) x max(statedim, 6*nodenum)
+mjtNum* ctrl_nominal = NULL;                // (stepnum+1) x actuatornum, the last step is spare
+mjtNum* ctrl_openloop = NULL;
+mjtNum* rest_length = NULL;
+mjtNum* delta_rest_length = NULL;
+mjtNum* state_target = NULL;                // max(statedim, 6*nodenum)
+AlignedMatrix stabilizer_feedback_gain;     // actuatornum x statedim
+const ModelConfig* model_config = NULL;
+CostProgram cost_program;                   // compiled "cost:" terms of the model, empty for the modelid branches
+const ModelKernel* model_kernel = NULL;     // fixed-dimension kernels of the model, NULL for the generic path
 
 // hyperparameters 
 mjtNum Q, QT, R;
-mjtNum Qm[kMaxState][kMaxState], QTm[kMaxState][kMaxState];
+AlignedMatrix Qm, QTm;                      // statedim x statedim
+
+/* Fixed-dimension kernels -------------------------------------------------*/
+// angle wrapping of the state error, ID folds the model branches at compile time
+template <int ID>
+static inline void angleWrap(mjtNum* state_error, const mjtNum* target)
+{
+	if (ID == 0)
+		state_error[0] = -(PI - fabs(target[0] - state_error[0] - PI))*((PI - target[0] + state_error[0] >= 0) - (PI - target[0] + state_error[0] < 0));
+	else if (ID == 15)
+		state_error[1] = -(PI - fabs(target[1] - state_error[1]))*((target[1] - state_error[1] <= 0) - (target[1] - state_error[1] > 0));
+	else if (ID == 3) {
+		state_error[0] = -(PI - fabs(target[0] - state_error[0] - PI))*((PI - target[0] + state_error[0] >= 0) - (PI - target[0] + state_error[0] < 0));
+		if (target[1] - state_error[1] >= 0) state_error[1] = -(fmod(target[1] - state_error[1] + PI, 2 * PI) - PI);
+		else state_error[1] = -(fmod(target[1] - state_error[1] - PI, 2 * PI) + PI);
+	}
+}
+
+// wrapped target - state for NQ position and NV velocity states, kept in registers by the callers
+template <int ID, int NQ, int NV>
+static inline void stateError(const mjData* d, const mjtNum* target, mjtNum* e)
+{
+	for (int i = 0; i < NQ; i++) e[i] = target[i] - d->qpos[i];
+	for (int i = 0; i < NV; i++) e[NQ + i] = target[NQ + i] - d->qvel[i];
+	angleWrap<ID>(e, target);
+}
+
+// quadratic state cost of stepCost, with the loops fully known at compile time
+template <int ID, int NQ, int NV, int NU>
+static mjtNum costFixed(const mjData* d, int step_index, const CostConfig* c)
+{
+	const int nx = NQ + NV;
+	const mjtNum* M = step_index >= stepnum ? c->QTm : c->Qm;
+	mjtNum e[nx], cost = 0, u = 0;
+
+	stateError<ID, NQ, NV>(d, c->target, e);
+	for (int i = 0; i < nx; i++) {
+		mjtNum r = 0;
+		for (int j = 0; j < nx; j++) r += M[i * nx + j] * e[j];
+		cost += e[i] * r;
+	}
+	if (step_index >= stepnum) return cost;
+	for (int i = 0; i < NU; i++) u += d->ctrl[i] * d->ctrl[i];
+	return cost + c->R * u;
+}
+
+// stabilizer feedback of terminalCtrl, ctrl = K * wrapped (state_target - state)
+template <int ID, int NQ, int NV, int NU>
+static void feedbackFixed(const mjData* d, mjtNum* ctrl)
+{
+	const int nx = NQ + NV;
+	const mjtNum* K = stabilizer_feedback_gain.data;
+	mjtNum e[nx];
+
+	stateError<ID, NQ, NV>(d, state_target, e);
+	for (int i = 0; i < NU; i++) {
+		mjtNum r = 0;
+		for (int j = 0; j < nx; j++) r += K[i * nx + j] * e[j];
+		ctrl[i] = r;
+	}
+}
+
+// instantiations for the registered models, the cost of models with "cost:" terms is compiled instead
+extern const ModelKernel model_kernels[] = {
+	{ "pendulum", 0, 1, 1, 1, costFixed<0, 1, 1, 1>, feedbackFixed<0, 1, 1, 1> },
+	{ "acrobot", 3, 2, 2, 1, costFixed<3, 2, 2, 1>, feedbackFixed<3, 2, 2, 1> },
+	{ "cartpole", 15, 2, 2, 1, costFixed<15, 2, 2, 1>, feedbackFixed<15, 2, 2, 1> },
+	{ "swimmer3", 13, 5, 5, 2, NULL, feedbackFixed<13, 5, 5, 2> },
+};
+extern const int model_kernel_num = sizeof(model_kernels) / sizeof(model_kernels[0]);
+
+int kernelSelect(const mjModel* m, int fixed)
+{
+	model_kernel = NULL;
+	for (int k = 0; fixed && k < model_kernel_num; k++) {
+		const ModelKernel* e = model_kernels + k;
+		if (e->id == modelid && e->nq == dof + quatnum && e->nv == dof && e->nu == actuatornum && m->nu == actuatornum)
+			model_kernel = e;
+	}
+	return model_kernel != NULL;
+}
 
 /* General function prototypes-----------------------------------------------*/
 bool terminalTrigger(mjModel* m, mjData* d, int modelid, int step_index)
@@ -58,12 +143,15 @@ bool terminalTrigger(mjModel* m, mjData* d, int modelid, int step_index)
 
 void terminalCtrl(mjModel* m, mjData* d, int step_index)
 {
-	mjtNum state_error[kMaxState];
+	if (model_kernel && model_kernel->feedback) model_kernel->feedback(d, d->ctrl);
+	else {
+		mjtNum state_error[kMaxState];
 
-	mju_sub(state_error, state_target, d->qpos, dof + quatnum); 
-	mju_sub(&state_error[dof + quatnum], &state_target[dof + quatnum], d->qvel, dof);
-	angleModify(modelid, state_error);
-	mju_mulMatVec(d->ctrl, *stabilizer_feedback_gain, state_error, m->nu, kMaxState);
+		mju_sub(state_error, state_target, d->qpos, dof + quatnum);
+		mju_sub(&state_error[dof + quatnum], &state_target[dof + quatnum], d->qvel, dof);
+		angleModify(modelid, state_error);
+		mju_mulMatVec(d->ctrl, stabilizer_feedback_gain.data, state_error, m->nu, statedim);
+	}
 	if (step_index <= stepnum) {
 		mju_add(d->ctrl, d->ctrl, ctrl_openloop, m->nu);
 		mju_sub(d->ctrl, d->ctrl, ctrl_nominal, m->nu);
@@ -81,17 +169,28 @@ void modelInit(mjModel* m, mjData* d, mjtNum* state_init)
 	mj_forward(m, d);
 }
 
-void angleModify(int modelid, mjtNum* state_error)
+void controlStep(const mjModel* m, mjData* d)
 {
-	if (modelid == 0)
-		state_error[0] = -(PI - fabs(state_target[0] - state_error[0] - PI))*((PI - state_target[0] + state_error[0] >= 0) - (PI - state_target[0] + state_error[0] < 0));
-	else if(modelid == 15)
-		state_error[1] = -(PI - fabs(state_target[1] - state_error[1]))*((state_target[1] - state_error[1] <= 0) - (state_target[1] - state_error[1] > 0));
-	else if (modelid == 3) {
-		state_error[0] = -(PI - fabs(state_target[0] - state_error[0] - PI))*((PI - state_target[0] + state_error[0] >= 0) - (PI - state_target[0] + state_error[0] < 0));
-		if(state_target[1] - state_error[1] >= 0) state_error[1] = -(fmod(state_target[1] - state_error[1] + PI, 2 * PI) - PI); 
-		else state_error[1] = -(fmod(state_target[1] - state_error[1] - PI, 2 * PI) + PI);
+	int i = 0;
+
+	if (m->opt.integrator == mjINT_EULER) {
+		mj_step2(m, d);
+		i = 1;
 	}
+	for (; i < integration_per_step; i++) mj_step(m, d);
+	mj_step1(m, d);
+}
+
+void angleModify(int modelid, mjtNum* state_error, const mjtNum* target)
+{
+	if (modelid == 0) angleWrap<0>(state_error, target);
+	else if (modelid == 15) angleWrap<15>(state_error, target);
+	else if (modelid == 3) angleWrap<3>(state_error, target);
+}
+
+void angleModify(int modelid, mjtNum* state_error)
+{
+	angleModify(modelid, state_error, state_target);
 }
 
 mjtNum angleModify(int modelid, mjtNum angle, int index)
@@ -118,488 +217,650 @@ void ctrlLimit(mjtNum* ctrl, int num)
 	}
 }
 
+void ctrlStep(mjtNum* ctrl, const mjtNum* step, mjtNum scale, mjtNum maxstep, int num)
+{
+	Map<Array<mjtNum, Dynamic, 1>> c(ctrl, num);
+	Map<const Array<mjtNum, Dynamic, 1>> s(step, num);
+	c = (c - (scale * s).max(-maxstep).min(maxstep)).max(ctrl_lowerlimit).min(ctrl_upperlimit);
+}
+
+// one Philox4x32-10 block
+static void philoxBlock(const uint32_t* key, const uint32_t* ctr, uint32_t* out)
+{
+	uint32_t k0 = key[0], k1 = key[1];
+	uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+
+	for (int round = 0; round < 10; round++) {
+		uint64_t p0 = (uint64_t)0xD2511F53 * c0;
+		uint64_t p1 = (uint64_t)0xCD9E8D57 * c2;
+		c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+		c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+		c1 = (uint32_t)p1;
+		c3 = (uint32_t)p0;
+		k0 += 0x9E3779B9;
+		k1 += 0xBB67AE85;
+	}
+	out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+}
+
+void randStreamInit(RandStream* s, uint64_t seed, uint32_t stream0, uint32_t stream1)
+{
+	s->key[0] = (uint32_t)seed;
+	s->key[1] = (uint32_t)(seed >> 32);
+	s->ctr[0] = 0;
+	s->ctr[1] = 0;
+	s->ctr[2] = stream0;
+	s->ctr[3] = stream1;
+}
+
+void randStreamSkip(RandStream* s, uint64_t nblock)
+{
+	uint64_t block = ((uint64_t)s->ctr[1] << 32 | s->ctr[0]) + nblock;
+	s->ctr[0] = (uint32_t)block;
+	s->ctr[1] = (uint32_t)(block >> 32);
+}
+
+void randGaussFill(RandStream* s, mjtNum* res, int n, mjtNum mean, mjtNum var)
+{
+	const int kBatch = 64;                  // blocks per batch, the transcendental loops below vectorize
+	const mjtNum kScale = 1.0 / 9007199254740992.0;
+	mjtNum radius[kBatch], angle[kBatch];
+	uint32_t out[4];
+	mjtNum std = sqrt(var);
+
+	for (int start = 0; start < n; start += 2 * kBatch) {
+		int nblock = mjMIN(kBatch, (n - start + 1) / 2);
+
+		// uniforms in (0, 1) from the raw bits
+		for (int b = 0; b < nblock; b++) {
+			philoxBlock(s->key, s->ctr, out);
+			randStreamSkip(s, 1);
+			radius[b] = ((mjtNum)((uint64_t)(out[0] >> 5) << 26 | out[1] >> 6) + 0.5) * kScale;
+			angle[b] = ((mjtNum)((uint64_t)(out[2] >> 5) << 26 | out[3] >> 6) + 0.5) * kScale;
+		}
+		for (int b = 0; b < nblock; b++) {
+			radius[b] = std * sqrt(-2.0 * log(radius[b]));
+			angle[b] = 2.0 * PI * angle[b];
+		}
+
+		// both Box-Muller outputs
+		mjtNum* dst = res + start;
+		int nout = mjMIN(2 * kBatch, n - start);
+		for (int b = 0; b < nout / 2; b++) {
+			dst[2 * b] = mean + radius[b] * cos(angle[b]);
+			dst[2 * b + 1] = mean + radius[b] * sin(angle[b]);
+		}
+		if (nout % 2) dst[nout - 1] = mean + radius[nout / 2] * cos(angle[nout / 2]);
+	}
+}
+
+// per-thread stream of randGauss, keeps the second Box-Muller output
+static thread_local RandStream rand_stream = { { 0, 0 }, { 0, 0, 0, 0 } };
+static thread_local mjtNum rand_spare;
+static thread_local bool rand_has_spare = false;
+
+void randSeed(uint64_t seed, uint32_t stream)
+{
+	randStreamInit(&rand_stream, seed, 0xFFFFFFFF, stream);
+	rand_has_spare = false;
+}
+
 mjtNum randGauss(mjtNum mean, mjtNum var)
 {
-	mjtNum U, V, Z;
+	mjtNum Z[2];
 
-	U = rand() / (RAND_MAX + 1.0);
-	V = rand() / (RAND_MAX + 1.0);
-	if (U == 0) U = 0.0001;
-	Z = sqrt(-2.0 * log(U)) * sin(2.0 * PI * V);
+	if (rand_has_spare) {
+		rand_has_spare = false;
+		return mean + sqrt(var) * rand_spare;
+	}
+	randGaussFill(&rand_stream, Z, 2);
+	rand_spare = Z[1];
+	rand_has_spare = true;
 
-	return mean + sqrt(var) * Z;
+	return mean + sqrt(var) * Z[0];
 }
 
 mjtNum *randGauss(mjtNum mean, mjtNum var, int n)
 {
-	mjtNum U, V, Z;
 	mjtNum *res = new mjtNum[n];
 
-	for (int i = 0; i < n; i++)
-	{
-		U = rand() / (RAND_MAX + 1.0);
-		V = rand() / (RAND_MAX + 1.0);
-		if (U == 0) U = 0.0001;
-		Z = sqrt(-2.0 * log(U)) * sin(2.0 * PI * V);
-		res[i] = mean + sqrt(var) * Z;
-	}
+	randGaussFill(&rand_stream, res, n, mean, var);
 	return res;
 }
 
-// model-depedent settings
-int modelSelection(const char* model)
+// bit reversal of a 32-bit word
+static uint32_t reverseBits(uint32_t x)
 {
-	if (_strcmpi(model, "pendulum") == 0) {
-		modelid = 0;
-		control_timestep = 0.01; //0.01 qmc
-		simulation_timestep = 0.01; //0.01
-		stepnum = 200; //200
-		dof = 1;
-		quatnum = 0;
-		actuatornum = 1;
-		rolloutnum_train = 1;
-		ctrl_upperlimit = 100;
-		ctrl_lowerlimit = -100;
-		mjtNum temp[1][2] = { 9.463564809357289, 1.193578631556765 };
-		for (int i = 0; i < actuatornum; i++) mju_copy(stabilizer_feedback_gain[i], temp[i], 2*dof+quatnum);
-		mjtNum temp1[kMaxState] = { PI, 0.0 };
-		mju_copy(state_nominal[0], temp1, 2*dof+quatnum);
-		mjtNum temp2[kMaxState] = { 2 * PI, 0.0 };
-		mju_copy(state_target, temp2, 2*dof+quatnum);
-		integration_per_step = (int)(control_timestep / simulation_timestep);
-		printf("Modeltype selected: %s\n", model);
-		return 1;
-	}
-	else if (_strcmpi(model, "cheetah") == 0) {
-		modelid = 1;
-		control_timestep = 0.01;
-		simulation_timestep = 0.01;
-		stepnum = 300;
-		dof = 9;
-		quatnum = 0;
-		actuatornum = 6;
-		rolloutnum_train = 200;
-		ctrl_upperlimit = 100;
-		ctrl_lowerlimit = -100;
-		mjtNum temp1[kMaxState] = { 0 };
-		mju_copy(state_nominal[0], temp1, 2*dof+quatnum);
-		mjtNum temp2[kMaxState] = { 0 };
-		mju_copy(state_target, temp2, 2*dof+quatnum);
-		integration_per_step = (int)(control_timestep / simulation_timestep);
-		printf("Modeltype selected: %s\n", model);
-		return 1;
-	}
-	else if (_strcmpi(model, "swimmer6") == 0) {
-		modelid = 2;
-		control_timestep = 0.006; //0.006
-		simulation_timestep = 0.006;
-		stepnum = 1500; //1500
-		dof = 8;
-		quatnum = 0;
-		actuatornum = 5;
-		rolloutnum_train = 50;
-		ctrl_upperlimit = 100;
-		ctrl_lowerlimit = -100;
-		mjtNum temp1[kMaxState] = { 0 };
-		mju_copy(state_nominal[0], temp1, 2*dof+quatnum);
-		mjtNum temp2[kMaxState] = { 0.6, -0.6, PI/4 };
-		mju_copy(state_target, temp2, 2*dof+quatnum);
-		integration_per_step = (int)(control_timestep / simulation_timestep);
-		printf("Modeltype selected: %s\n", model);
-		return 1;
-	}
-	else if (_strcmpi(model, "acrobot") == 0) {
-		modelid = 3;
-		control_timestep = 0.02;
-		simulation_timestep = 0.02;
-		stepnum = 400;
-		dof = 2;
-		quatnum = 0;
-		actuatornum = 1;
-		rolloutnum_train = 100;
-		mjtNum temp[1][4] = {0};// { -240.3429644433826, -60.4349625481677, -88.3643552434026, -25.7046399010518 };
-		for (int i = 0; i < actuatornum; i++) mju_copy(stabilizer_feedback_gain[i], temp[i], 2*dof+quatnum);
-		mjtNum temp1[kMaxState] = { PI, 0.0, 0, 0 };
-		mju_copy(state_nominal[0], temp1, 2*dof+quatnum);
-		mjtNum temp2[kMaxState] = { 0 };
-		mju_copy(state_target, temp2, 2*dof+quatnum);
-		integration_per_step = (int)(control_timestep / simulation_timestep);
-		printf("Modeltype selected: %s\n", model);
-		return 1;
-	}
-	else if (_strcmpi(model, "dbar") == 0) {
-		modelid = 4;
-		control_timestep = 0.01;
-		simulation_timestep = 0.01;
-		stepnum = 200; 
-		dof = 2;
-		quatnum = 0;
-		actuatornum = 4;
-		rolloutnum_train = 10;
-		ctrl_upperlimit = 1000;
-		ctrl_lowerlimit = -1000;
-		integration_per_step = (int)(control_timestep / simulation_timestep);
-		printf("Modeltype selected: %s\n", model);
-		return 1;
+	x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+	x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+	x = ((x >> 4) & 0x0F0F0F0F) | ((x & 0x0F0F0F0F) << 4);
+	x = ((x >> 8) & 0x00FF00FF) | ((x & 0x00FF00FF) << 8);
+	return (x >> 16) | (x << 16);
+}
+// Sobol direction numbers of dimensions 2..kSobolDim (Joe and Kuo, new-joe-kuo-6.21201): degree, coefficients, initial m
+static const int kSobolDim = 32;
+static const int sobol_degree[kSobolDim - 1] = { 1, 2, 3, 3, 4, 4, 5, 5, 5, 5, 5, 5, 6, 6, 6, 6, 6, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7 };
+static const int sobol_coef[kSobolDim - 1] = { 0, 1, 1, 2, 1, 4, 2, 4, 7, 11, 13, 14, 1, 13, 16, 19, 22, 25, 1, 4, 7, 8, 14, 19, 21, 28, 31, 32, 37, 41, 42 };
+static const int sobol_minit[kSobolDim - 1][7] = {
+	{ 1 }, { 1, 3 }, { 1, 3, 1 }, { 1, 1, 1 },
+	{ 1, 1, 3, 3 }, { 1, 3, 5, 13 }, { 1, 1, 5, 5, 17 }, { 1, 1, 5, 5, 5 },
+	{ 1, 1, 7, 11, 19 }, { 1, 1, 5, 1, 1 }, { 1, 1, 1, 3, 11 }, { 1, 3, 5, 5, 31 },
+	{ 1, 3, 3, 9, 7, 49 }, { 1, 1, 1, 15, 21, 21 }, { 1, 3, 1, 13, 27, 49 }, { 1, 1, 1, 15, 7, 5 },
+	{ 1, 3, 1, 15, 13, 25 }, { 1, 1, 5, 5, 19, 61 }, { 1, 3, 7, 11, 23, 15, 103 }, { 1, 3, 7, 13, 13, 15, 69 },
+	{ 1, 1, 3, 13, 7, 35, 63 }, { 1, 3, 5, 9, 1, 25, 53 }, { 1, 3, 1, 13, 9, 35, 107 }, { 1, 3, 1, 5, 27, 61, 31 },
+	{ 1, 1, 5, 11, 19, 41, 61 }, { 1, 3, 5, 3, 3, 13, 69 }, { 1, 1, 7, 13, 1, 19, 1 }, { 1, 3, 7, 5, 13, 19, 59 },
+	{ 1, 1, 3, 9, 25, 29, 41 }, { 1, 3, 5, 13, 23, 1, 55 }, { 1, 3, 7, 3, 13, 59, 17 },
+};
+static uint32_t sobol_v[kSobolDim][32];
+
+// direction numbers of all dimensions, called once
+static bool sobolInit(void)
+{
+	for (int b = 0; b < 32; b++) sobol_v[0][b] = 1u << (31 - b);
+	for (int j = 1; j < kSobolDim; j++) {
+		int s = sobol_degree[j - 1], a = sobol_coef[j - 1];
+		uint32_t m[32];
+
+		for (int b = 0; b < s; b++) m[b] = sobol_minit[j - 1][b];
+		for (int b = s; b < 32; b++) {
+			m[b] = m[b - s] ^ (m[b - s] << s);
+			for (int k = 1; k < s; k++)
+				if ((a >> (s - 1 - k)) & 1) m[b] ^= m[b - k] << k;
+		}
+		for (int b = 0; b < 32; b++) sobol_v[j][b] = m[b] << (31 - b);
 	}
-	else if (_strcmpi(model, "finger") == 0) {
-		modelid = 5;
-		control_timestep = 0.04;
-		simulation_timestep = 0.04;
-		stepnum = 200;
-		dof = 5;
-		quatnum = 0;
-		actuatornum = 10;
-		rolloutnum_train = 300;
-		integration_per_step = (int)(control_timestep / simulation_timestep);
-		printf("Modeltype selected: %s\n", model);
-		return 1;
+	return true;
+}
+
+// nested uniform (Owen) scramble of a 32-bit fixed-point coordinate, hash-based Laine-Karras permutation on the reversed bits
+static uint32_t owenScramble(uint32_t x, uint32_t seed)
+{
+	x = reverseBits(x);
+	x ^= x * 0x3d20adea;
+	x += seed;
+	x *= (seed >> 16) | 1;
+	x ^= x * 0x05526c56;
+	x ^= x * 0x53a22864;
+	return reverseBits(x);
+}
+
+mjtNum normalInv(mjtNum p)
+{
+	// rational approximations of Acklam, relative error below 1.2e-9
+	static const mjtNum a[6] = { -3.969683028665376e+01, 2.209460984245205e+02, -2.759285104469687e+02, 1.383577518672690e+02, -3.066479806614716e+01, 2.506628277459239e+00 };
+	static const mjtNum b[5] = { -5.447609879822406e+01, 1.615858368580409e+02, -1.556989798598866e+02, 6.680131188771972e+01, -1.328068155288572e+01 };
+	static const mjtNum c[6] = { -7.784894002430293e-03, -3.223964580411365e-01, -2.400758277161838e+00, -2.549732539343734e+00, 4.374664141464968e+00, 2.938163982698783e+00 };
+	static const mjtNum e[4] = { 7.784695709041462e-03, 3.224671290700398e-01, 2.445134137142996e+00, 3.754408661907416e+00 };
+	const mjtNum kLow = 0.02425;
+
+	if (p < kLow) {
+		mjtNum q = sqrt(-2 * log(p));
+		return (((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5]) / ((((e[0] * q + e[1]) * q + e[2]) * q + e[3]) * q + 1);
 	}
-	else if (_strcmpi(model, "arm") == 0) {
-		modelid = 6;
-		control_timestep = 0.01;
-		simulation_timestep = 0.01;
-		stepnum = 400;
-		dof = 9;
-		quatnum = 0;
-		actuatornum = 38;
-		rolloutnum_train = 20;
-		ctrl_upperlimit = 0;
-		ctrl_lowerlimit = -100;
-		integration_per_step = (int)(control_timestep / simulation_timestep);
-		printf("Modeltype selected: %s\n", model);
-		return 1;
+	if (p > 1 - kLow) {
+		mjtNum q = sqrt(-2 * log(1 - p));
+		return -(((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5]) / ((((e[0] * q + e[1]) * q + e[2]) * q + e[3]) * q + 1);
 	}
-	else if (_strcmpi(model, "swimmer6t") == 0) {
-		modelid = 7;
-		control_timestep = 0.006;
-		simulation_timestep = 0.006;
-		stepnum = 1500;
-		dof = 8;
-		quatnum = 0;
-		actuatornum = 22;
-		rolloutnum_train = 30;
-		ctrl_upperlimit = 100;
-		ctrl_lowerlimit = -100;
-		integration_per_step = (int)(control_timestep / simulation_timestep);
-		printf("Modeltype selected: %s\n", model);
-		return 1;
+	mjtNum q = p - 0.5, r = q * q;
+	return (((((a[0] * r + a[1]) * r + a[2]) * r + a[3]) * r + a[4]) * r + a[5]) * q / (((((b[0] * r + b[1]) * r + b[2]) * r + b[3]) * r + b[4]) * r + 1);
+}
+
+int sobolChunkNum(int n)
+{
+	return (n + kSobolDim - 1) / kSobolDim;
+}
+
+void sobolPointOrder(uint64_t seed, uint32_t stream, int* order, int npoint, int nchunk)
+{
+	RandStream s;
+	uint32_t out[4];
+
+	for (int chunk = 0; chunk < nchunk; chunk++) {
+		int* chunk_order = order + (size_t)chunk * npoint;
+
+		// Fisher-Yates shuffle, one 32-bit draw per swap
+		randStreamInit(&s, seed, stream, 0x80000000u | (2 * chunk + 1));
+		for (int i = 0; i < npoint; i++) chunk_order[i] = i;
+		for (int i = npoint - 1; i > 0; i--) {
+			if ((npoint - 1 - i) % 4 == 0) {
+				philoxBlock(s.key, s.ctr, out);
+				randStreamSkip(&s, 1);
+			}
+			int j = (int)(((uint64_t)out[(npoint - 1 - i) % 4] * (i + 1)) >> 32);
+			int tmp = chunk_order[i];
+			chunk_order[i] = chunk_order[j];
+			chunk_order[j] = tmp;
+		}
 	}
-	else if (_strcmpi(model, "t1d1") == 0) {
-		modelid = 8;
-		control_timestep = 0.01;
-		simulation_timestep = 0.01;
-		stepnum = 300;
-		dof = 6;
-		quatnum = 0;
-		actuatornum = 10;
-		rolloutnum_train = 20;
-		ctrl_upperlimit = 0;
-		ctrl_lowerlimit = -100;
-		integration_per_step = (int)(control_timestep / simulation_timestep);
-		printf("Modeltype selected: %s\n", model);
-		return 1;
+}
+
+void sobolGaussFill(uint64_t seed, uint32_t stream, const int* order, int npoint, int point, mjtNum* res, int n, mjtNum mean, mjtNum var)
+{
+	static const bool init = sobolInit();
+	RandStream s;
+	uint32_t scramble[kSobolDim];
+	mjtNum std = sqrt(var);
+
+	(void)init;
+	for (int chunk = 0; chunk < sobolChunkNum(n); chunk++) {
+		int ndim = mjMIN(kSobolDim, n - chunk * kSobolDim);
+		uint32_t index = order[(size_t)chunk * npoint + point];
+		uint32_t gray = index ^ (index >> 1);
+
+		// scramble seeds of this chunk, shared by all points of the batch
+		randStreamInit(&s, seed, stream, 0x80000000u | (2 * chunk));
+		for (int j = 0; j < ndim; j += 4) {
+			philoxBlock(s.key, s.ctr, scramble + j);
+			randStreamSkip(&s, 1);
+		}
+
+		// Sobol point, scrambled and mapped to the Gaussian
+		for (int j = 0; j < ndim; j++) {
+			uint32_t x = 0;
+			for (int b = 0; gray >> b; b++)
+				if ((gray >> b) & 1) x ^= sobol_v[j][b];
+			x = owenScramble(x, scramble[j]);
+			res[chunk * kSobolDim + j] = mean + std * normalInv(((mjtNum)x + 0.5) * (1.0 / 4294967296.0));
+		}
 	}
-	else if (_strcmpi(model, "t2d1") == 0) {
-		modelid = 9;
-		control_timestep = 0.01;
-		simulation_timestep = 0.01;
-		stepnum = 400;
-		dof = 14;
-		quatnum = 0;		
-		actuatornum = 22;
-		rolloutnum_train = 30;//300
-		ctrl_upperlimit = 0;
-		ctrl_lowerlimit = -1000;
-		integration_per_step = (int)(control_timestep / simulation_timestep);
-		printf("Modeltype selected: %s\n", model);
-		return 1;
+}
+
+void bsplineBasis(mjtNum* res, int nstep, int nbasis)
+{
+	const int kDegree = 3;
+	int nknot = nbasis + kDegree + 1;
+	mjtNum* knot = new mjtNum[nknot];
+	mjtNum* b = new mjtNum[nknot];
+	mjtNum span = nbasis - kDegree;
+
+	// clamped uniform knots on [0, nbasis - 3]
+	for (int i = 0; i < nknot; i++) knot[i] = mjMAX(0, mjMIN(span, i - kDegree));
+	for (int s = 0; s < nstep; s++) {
+		mjtNum u = nstep > 1 ? span * s / (nstep - 1) : 0;
+
+		// Cox-de Boor recursion, the last knot span is closed
+		for (int i = 0; i < nknot - 1; i++)
+			b[i] = (knot[i] <= u && (u < knot[i + 1] || (u == span && knot[i + 1] == span && knot[i] < span))) ? 1 : 0;
+		for (int p = 1; p <= kDegree; p++)
+			for (int i = 0; i < nknot - 1 - p; i++) {
+				mjtNum left = knot[i + p] > knot[i] ? (u - knot[i]) / (knot[i + p] - knot[i]) * b[i] : 0;
+				mjtNum right = knot[i + p + 1] > knot[i + 1] ? (knot[i + p + 1] - u) / (knot[i + p + 1] - knot[i + 1]) * b[i + 1] : 0;
+				b[i] = left + right;
+			}
+		mju_copy(res + s * nbasis, b, nbasis);
 	}
-	else if (_strcmpi(model, "fish") == 0) {
-		modelid = 10;
-		control_timestep = 0.005; // 0.004
-		simulation_timestep = 0.005;
-		stepnum = 1200; // 2000
-		dof = 13;
-		quatnum = 1;
-		actuatornum = 6;
-		rolloutnum_train = 30;//300
-		ctrl_upperlimit = 300;
-		ctrl_lowerlimit = -300;
-		mjtNum temp1[kMaxState] = { 0.0, 0.0, 0, 1, 0, 0, 0 }; // X Y Z QUAT
-		mju_copy(state_nominal[0], temp1, 2 * dof + quatnum); 
-		integration_per_step = (int)(control_timestep / simulation_timestep);
-		printf("Modeltype selected: %s\n", model);
-		return 1;
+	delete[] knot;
+	delete[] b;
+}
+
+void dctBasis(mjtNum* res, int nstep, int nbasis)
+{
+	for (int s = 0; s < nstep; s++)
+		for (int k = 0; k < nbasis; k++)
+			res[s * nbasis + k] = cos(PI * k * (s + 0.5) / nstep);
+}
+
+// model registry, one entry per model config file, keyed by the lower case model name
+unordered_map<string, ModelConfig> model_registry;
+char model_dir[100] = "";           // directory of the last model path selected, bare model names are looked up there
+
+// lower case name of a model or config file without directory and extension
+static string modelKey(const char* name)
+{
+	string key(name);
+	size_t pos = key.find_last_of("/\\");
+	if (pos != string::npos) key = key.substr(pos + 1);
+	if ((pos = key.rfind(".cfg")) != string::npos && pos + 4 == key.size()) key.resize(pos);
+	for (size_t i = 0; i < key.size(); i++) key[i] = (char)tolower(key[i]);
+	return key;
+}
+
+int modelRegister(const char* filename)
+{
+	FILE *fop;
+	char buff[100];
+	ModelConfig c;
+	vector<mjtNum>* list = NULL;
+	string* term = NULL;
+
+	if ((fop = fopen(filename, "r")) == NULL) return 0;
+	while (fscanf(fop, "%99s", buff) == 1) {
+		// a token ending with ':' starts a key, the numbers after it are its values
+		size_t len = strlen(buff);
+		if (buff[len - 1] != ':') {
+			if (list) list->push_back(atof(buff));
+			else if (term) term->append(term->empty() ? "" : " ").append(buff);
+			continue;
+		}
+		list = NULL;
+		term = NULL;
+		if (strcmp(buff, "id:") == 0 && fscanf(fop, "%99s", buff) == 1) c.id = atoi(buff);
+		else if (strcmp(buff, "control_timestep:") == 0 && fscanf(fop, "%99s", buff) == 1) c.control_timestep = atof(buff);
+		else if (strcmp(buff, "simulation_timestep:") == 0 && fscanf(fop, "%99s", buff) == 1) c.simulation_timestep = atof(buff);
+		else if (strcmp(buff, "stepnum:") == 0 && fscanf(fop, "%99s", buff) == 1) c.stepnum = atoi(buff);
+		else if (strcmp(buff, "rolloutnum_train:") == 0 && fscanf(fop, "%99s", buff) == 1) c.rolloutnum_train = atoi(buff);
+		else if (strcmp(buff, "nodenum:") == 0 && fscanf(fop, "%99s", buff) == 1) c.nodenum = atoi(buff);
+		else if (strcmp(buff, "dof:") == 0 && fscanf(fop, "%99s", buff) == 1) c.dof = atoi(buff);
+		else if (strcmp(buff, "quatnum:") == 0 && fscanf(fop, "%99s", buff) == 1) c.quatnum = atoi(buff);
+		else if (strcmp(buff, "actuatornum:") == 0 && fscanf(fop, "%99s", buff) == 1) c.actuatornum = atoi(buff);
+		else if (strcmp(buff, "ctrl_upperlimit:") == 0 && fscanf(fop, "%99s", buff) == 1) c.ctrl_upperlimit = atof(buff);
+		else if (strcmp(buff, "ctrl_lowerlimit:") == 0 && fscanf(fop, "%99s", buff) == 1) c.ctrl_lowerlimit = atof(buff);
+		else if (strcmp(buff, "state_init:") == 0) list = &c.state_init;
+		else if (strcmp(buff, "state_target:") == 0) list = &c.state_target;
+		else if (strcmp(buff, "feedback_gain:") == 0) list = &c.feedback_gain;
+		else if (strcmp(buff, "cost:") == 0) {
+			c.cost.push_back("");
+			term = &c.cost.back();
+		}
+		else printf("Unknown key %s in %s\n", buff, filename);
 	}
-	else if (_strcmpi(model, "dbar3d") == 0) {
-		modelid = 11;
-		control_timestep = 0.01;
-		simulation_timestep = 0.01;
-		stepnum = 200;
-		dof = 1;
-		quatnum = 1;
-		actuatornum = 7;
-		nodenum = 4;
-		rolloutnum_train = 50;
-		ctrl_upperlimit = 0;
-		ctrl_lowerlimit = -1000;
-		mjtNum temp1[kMaxState] = { 0 };
-		mju_copy(state_nominal[0], temp1, 2 * dof + quatnum);
-		integration_per_step = (int)(control_timestep / simulation_timestep);
-		printf("Modeltype selected: %s\n", model);
-		return 1;
+	fclose(fop);
+	if (c.id < 0 || c.control_timestep <= 0 || c.simulation_timestep <= 0 || c.stepnum <= 0) {
+		printf("Incomplete model config %s\n", filename);
+		return 0;
 	}
-	else if (_strcmpi(model, "pendulum3d") == 0) {
-		modelid = 12;
-		control_timestep = 0.01;
-		simulation_timestep = 0.01;
-		stepnum = 200;
-		dof = 3;
-		quatnum = 1;
-		actuatornum = 3;
-		rolloutnum_train = 20;
-		ctrl_upperlimit = 0;
-		ctrl_lowerlimit = -1000;
-		mjtNum temp[3][7] = { 0 };
-		for (int i = 0; i < actuatornum; i++) mju_copy(stabilizer_feedback_gain[i], temp[i], 2 * dof + quatnum);
-		mjtNum temp1[kMaxState] = { 1.0, 0.0, 0, 0 };
-		mju_copy(state_nominal[0], temp1, 2 * dof + quatnum);
-		integration_per_step = (int)(control_timestep / simulation_timestep);
-		printf("Modeltype selected: %s\n", model);
-		return 1;
+	model_registry[modelKey(filename)] = c;
+	return 1;
+}
+
+const ModelConfig* modelLookup(const char* model)
+{
+	unordered_map<string, ModelConfig>::const_iterator it = model_registry.find(modelKey(model));
+	return it == model_registry.end() ? NULL : &it->second;
+}
+
+// model-depedent settings
+int modelSelection(const char* model)
+{
+	const char* name = model;
+	const char* sep = mjMAX(strrchr(model, '/'), strrchr(model, '\\'));
+	char filename[200];
+
+	// a model file path sets the config directory, a bare name is looked up there and in model/
+	if (sep) {
+		name = sep + 1;
+		size_t len = mjMIN((size_t)(sep + 1 - model), sizeof(model_dir) - 1);
+		strncpy(model_dir, model, len);
+		model_dir[len] = 0;
 	}
-	else if (_strcmpi(model, "swimmer3") == 0) {
-		modelid = 13;
-		control_timestep = 0.01; //0.005
-		simulation_timestep = 0.01;
-		stepnum = 950; //1600
-		dof = 5;
-		quatnum = 0;
-		actuatornum = 2;
-		rolloutnum_train = 40;
-		ctrl_upperlimit = 100;
-		ctrl_lowerlimit = -100;
-		mjtNum temp1[kMaxState] = { 0 };
-		mju_copy(state_nominal[0], temp1, 2 * dof + quatnum);
-		mjtNum temp2[kMaxState] = { 0.6, -0.6, PI/4, 0, 0 };
-		mju_copy(state_target, temp2, 2 * dof + quatnum);
-		integration_per_step = (int)(control_timestep / simulation_timestep);
-		printf("Modeltype selected: %s\n", model);
-		return 1;
+	const ModelConfig* c = modelLookup(name);
+	if (!c) {
+		snprintf(filename, sizeof(filename), "%s%s.cfg", model_dir, name);
+		if (!modelRegister(filename)) {
+			snprintf(filename, sizeof(filename), "model/%s.cfg", name);
+			if (!modelRegister(filename)) return 0;
+		}
+		c = modelLookup(name);
 	}
-	else if (_strcmpi(model, "t1d1_3d") == 0) {
-		modelid = 14;
-		control_timestep = 0.01;
-		simulation_timestep = 0.01; //0.001
-		stepnum = 200; //5, 300
-		dof = 1;
-		quatnum = 1;
-		actuatornum = 20;
-		nodenum = 11;
-		rolloutnum_train = 50;
-		ctrl_upperlimit = 0;
-		ctrl_lowerlimit = -1000;
-		mjtNum temp1[kMaxState] = { 0 };
-		mju_copy(state_nominal[0], temp1, 2 * dof + quatnum);
-		integration_per_step = (int)(control_timestep / simulation_timestep);
-		printf("Modeltype selected: %s\n", model);
-		return 1;
+
+	// the dimensions are final after modelDimension with the loaded model
+	model_config = c;
+	modelid = c->id;
+	control_timestep = c->control_timestep;
+	simulation_timestep = c->simulation_timestep;
+	stepnum = c->stepnum;
+	rolloutnum_train = c->rolloutnum_train;
+	nodenum = c->nodenum;
+	dof = c->dof;
+	quatnum = c->quatnum;
+	actuatornum = c->actuatornum;
+	ctrl_upperlimit = c->ctrl_upperlimit;
+	ctrl_lowerlimit = c->ctrl_lowerlimit;
+	integration_per_step = (int)(control_timestep / simulation_timestep);
+	printf("Modeltype selected: %s\n", name);
+	return 1;
+}
+
+mjtNum* alignedAlloc(size_t num)
+{
+	// the offset to the aligned start is kept in front of it for alignedFree
+	char* raw = (char*)calloc(num * sizeof(mjtNum) + kAlign + sizeof(size_t), 1);
+	if (!raw) return NULL;
+	size_t offset = kAlign - ((size_t)(raw + sizeof(size_t)) % kAlign) + sizeof(size_t);
+	((size_t*)(raw + offset))[-1] = offset;
+	return (mjtNum*)(raw + offset);
+}
+
+void alignedFree(mjtNum* ptr)
+{
+	if (ptr) free((char*)ptr - ((size_t*)ptr)[-1]);
+}
+
+void matrixResize(AlignedMatrix* a, int rows, int cols)
+{
+	alignedFree(a->data);
+	a->data = alignedAlloc((size_t)rows * cols);
+	a->rows = rows;
+	a->cols = cols;
+}
+
+int modelDimension(const mjModel* m)
+{
+	const ModelConfig* c = model_config;
+
+	if (!c) return 0;
+	dof = c->dof > 0 ? c->dof : m->nv;
+	quatnum = c->quatnum >= 0 ? c->quatnum : m->nq - m->nv;
+	actuatornum = c->actuatornum > 0 ? c->actuatornum : m->nu;
+	statedim = 2 * dof + quatnum;
+	if ((c->dof > 0) != (c->quatnum >= 0) && (dof != m->nv || quatnum != m->nq - m->nv))
+		printf("Warning: config of model id %d sets only one of dof and quatnum, dof %d and quatnum %d disagree with nv %d and nq - nv %d\n",
+			modelid, dof, quatnum, m->nv, m->nq - m->nv);
+	int width = mjMAX(statedim, 6 * nodenum);
+	if (width > kMaxState || actuatornum > kMaxState || stepnum <= 0) return 0;
+
+	// right-sized storage, zero like the former static arrays
+	size_t nctrl = (size_t)(stepnum + 1) * actuatornum;
+	matrixResize(&state_nominal, stepnum + 1, width);
+	matrixResize(&stabilizer_feedback_gain, actuatornum, statedim);
+	matrixResize(&Qm, statedim, statedim);
+	matrixResize(&QTm, statedim, statedim);
+	alignedFree(ctrl_nominal);
+	alignedFree(ctrl_openloop);
+	alignedFree(rest_length);
+	alignedFree(delta_rest_length);
+	alignedFree(state_target);
+	ctrl_nominal = alignedAlloc(nctrl);
+	ctrl_openloop = alignedAlloc(nctrl);
+	rest_length = alignedAlloc(nctrl);
+	delta_rest_length = alignedAlloc(nctrl);
+	state_target = alignedAlloc(width);
+	if (!state_nominal.data || !stabilizer_feedback_gain.data || !Qm.data || !QTm.data ||
+		!ctrl_nominal || !ctrl_openloop || !rest_length || !delta_rest_length || !state_target) return 0;
+
+	// vectors of the config fill the leading entries, the rest is zero
+	for (int i = 0; i < mjMIN((int)c->state_init.size(), statedim); i++) state_nominal[0][i] = c->state_init[i];
+	for (int i = 0; i < mjMIN((int)c->state_target.size(), statedim); i++) state_target[i] = c->state_target[i];
+	for (int i = 0; i < mjMIN((int)c->feedback_gain.size(), actuatornum * statedim); i++)
+		stabilizer_feedback_gain.data[i] = c->feedback_gain[i];
+	kernelSelect(m, 1);
+	return costCompile(m);
+}
+
+// sources of the cost operands, in the order stepCost gathers them from mjData
+enum { kSrcQpos, kSrcQvel, kSrcCtrl, kSrcSite, kSrcGeom, kSrcBody, kSrcXmat, kSrcSensor, kSrcZero, kCostSource };
+static const mjtNum cost_zero[1] = { 0 };
+
+// parse a number token, 0 if the token is not a number
+static int costNumber(const char* token, mjtNum* value)
+{
+	char* end;
+
+	*value = strtod(token, &end);
+	return end != token && *end == 0;
+}
+
+// object id by name, or the id itself if the name is a number, -1 if not found
+static int costObject(const mjModel* m, int type, const char* name, int num)
+{
+	int id = mj_name2id(m, type, name);
+
+	if (id < 0 && name[0] >= '0' && name[0] <= '9') id = atoi(name);
+	return id >= 0 && id < num ? id : -1;
+}
+
+// resolve an operand token to its source array, first index and number of values, 0 if invalid
+static int costOperand(const mjModel* m, const char* token, int* source, int* index, int* count)
+{
+	char kind[30] = "", name[100] = "", comp[10] = "";
+	int id, first, last, num;
+
+	sscanf(token, "%29[^:]:%99[^:]:%9s", kind, name, comp);
+	*count = 1;
+	if (strcmp(kind, "qpos") == 0 || strcmp(kind, "qvel") == 0 || strcmp(kind, "ctrl") == 0 || strcmp(kind, "sensordata") == 0) {
+		*source = kind[0] == 'c' ? kSrcCtrl : kind[0] == 's' ? kSrcSensor : kind[1] == 'p' ? kSrcQpos : kSrcQvel;
+		num = *source == kSrcQpos ? m->nq : *source == kSrcQvel ? m->nv : *source == kSrcCtrl ? actuatornum : m->nsensordata;
+		first = 0;
+		last = num - 1;
+		if (name[0]) {
+			int n = sscanf(name, "%d-%d", &first, &last);
+			if (n < 1) return 0;
+			if (n == 1) last = first;
+		}
+		*index = first;
+		*count = last - first + 1;
+		return first >= 0 && last < num && *count > 0;
 	}
-	else if (_strcmpi(model, "cartpole") == 0) {
-		modelid = 15;
-		control_timestep = 0.1; //0.01 qmc
-		simulation_timestep = 0.1; //0.01
-		stepnum = 30; //300
-		dof = 2;
-		quatnum = 0;
-		actuatornum = 1;
-		rolloutnum_train = 1;
-		ctrl_upperlimit = 100;
-		ctrl_lowerlimit = -100;
-		mjtNum temp[1][4] = { -6.542245202164158, - 58.135743265102924, - 8.560886179516817, - 12.848142686878143 };// { -13.092556577239106, -64.598908804911986, -11.404678463728189, -13.703401036812515 };
-		for (int i = 0; i < actuatornum; i++) mju_copy(stabilizer_feedback_gain[i], temp[i], 2 * dof + quatnum);
-		mjtNum temp1[kMaxState] = { 0 };
-		mju_copy(state_nominal[0], temp1, 2 * dof + quatnum);
-		mjtNum temp2[kMaxState] = { 0, -PI, 0, 0 };
-		mju_copy(state_target, temp2, 2 * dof + quatnum);
-		integration_per_step = (int)(control_timestep / simulation_timestep);
-		printf("Modeltype selected: %s\n", model);
+	if (strcmp(kind, "joint") == 0 || strcmp(kind, "jointvel") == 0) {
+		if ((id = costObject(m, mjOBJ_JOINT, name, m->njnt)) < 0) return 0;
+		*source = kind[5] ? kSrcQvel : kSrcQpos;
+		*index = kind[5] ? m->jnt_dofadr[id] : m->jnt_qposadr[id];
 		return 1;
 	}
-	else if (_strcmpi(model, "t2d1_3d") == 0) {
-		modelid = 16;
-		control_timestep = 0.01;
-		simulation_timestep = 0.01; //0.001
-		stepnum = 200; //5, 300
-		dof = 1;
-		quatnum = 1;
-		actuatornum = 46;
-		nodenum = 25;
-		rolloutnum_train = 60;
-		ctrl_upperlimit = 0;
-		ctrl_lowerlimit = -1000;
-		mjtNum temp1[kMaxState] = { 0 };
-		mju_copy(state_nominal[0], temp1, 2 * dof + quatnum);
-		integration_per_step = (int)(control_timestep / simulation_timestep);
-		printf("Modeltype selected: %s\n", model);
+	if (strcmp(kind, "sensor") == 0) {
+		if ((id = costObject(m, mjOBJ_SENSOR, name, m->nsensor)) < 0) return 0;
+		*source = kSrcSensor;
+		*index = m->sensor_adr[id];
+		if (!comp[0]) *count = m->sensor_dim[id];
+		else if ((*index += atoi(comp)) >= m->sensor_adr[id] + m->sensor_dim[id]) return 0;
 		return 1;
 	}
-	else if (_strcmpi(model, "swimmer15") == 0) {
-		modelid = 17;
-		control_timestep = 0.005;
-		simulation_timestep = 0.005; // 0.006 1500
-		stepnum = 2400;
-		dof = 17;
-		quatnum = 0;
-		actuatornum = 14;
-		rolloutnum_train = 500;
-		ctrl_upperlimit = 1000;
-		ctrl_lowerlimit = -1000;
-		mjtNum temp1[kMaxState] = { 0 };
-		mju_copy(state_nominal[0], temp1, 2 * dof + quatnum);
-		integration_per_step = (int)(control_timestep / simulation_timestep);
-		mjtNum temp2[kMaxState] = { 0.6, -0.6, PI / 4, 0, 0 };
-		mju_copy(state_target, temp2, 2 * dof + quatnum);
-		printf("Modeltype selected: %s\n", model);
+	if (strcmp(kind, "xmat") == 0) {
+		if ((id = costObject(m, mjOBJ_BODY, name, m->nbody)) < 0 || comp[0] < '0' || comp[0] > '8') return 0;
+		*source = kSrcXmat;
+		*index = 9 * id + comp[0] - '0';
 		return 1;
 	}
-	return 0;
+	if (comp[0] < 'x' || comp[0] > 'z') return 0;
+	if (strcmp(kind, "site") == 0) id = costObject(m, mjOBJ_SITE, name, m->nsite), *source = kSrcSite;
+	else if (strcmp(kind, "geom") == 0) id = costObject(m, mjOBJ_GEOM, name, m->ngeom), *source = kSrcGeom;
+	else if (strcmp(kind, "body") == 0) id = costObject(m, mjOBJ_BODY, name, m->nbody), *source = kSrcBody;
+	else return 0;
+	*index = 3 * id + comp[0] - 'x';
+	return id >= 0;
 }
 
-// return the cost value at the given step
-mjtNum stepCost(mjModel* m, mjData* d, int step_index)
+int costCompile(const mjModel* m)
 {
-	mjtNum state[kMaxState], res0[kMaxState] = { 0 }, res1[kMaxState] = { 0 }, cost;
+	vector<CostOp> group[4];
+	char buff[500];
 
-	mju_copy(state, d->qpos, dof + quatnum);
-	mju_copy(&state[dof + quatnum], d->qvel, dof);
-	
-	if (modelid == 0) {
-		mju_sub(res0, state_target, state, 2*dof + quatnum);
-		angleModify(modelid, res0);
-		if (step_index >= stepnum) {
-			mju_mulMatVec(res1, *QTm, res0, kMaxState, kMaxState);
-			cost = mju_dot(res0, res1, 2 * dof + quatnum);
+	cost_program.op.clear();
+	for (int g = 0; g < 5; g++) cost_program.start[g] = 0;
+	if (!model_config) return 0;
+	for (size_t t = 0; t < model_config->cost.size(); t++) {
+		CostOp op = { 0, 0, kSrcZero, 0, 1, 0, 0, -mjMAXVAL, mjMAXVAL };
+		int phase = 0, na = 0, nb = 1, ok = 1;
+		char* token;
+
+		// phase, weight and first operand, then a second operand, the target and clamps in any order
+		snprintf(buff, sizeof(buff), "%s", model_config->cost[t].c_str());
+		token = strtok(buff, " ");
+		if (token) phase = strcmp(token, "running") == 0 ? 1 : strcmp(token, "terminal") == 0 ? 2 : strcmp(token, "both") == 0 ? 3 : 0;
+		token = strtok(NULL, " ");
+		ok = phase && token && costNumber(token, &op.weight);
+		token = strtok(NULL, " ");
+		ok = ok && token && costOperand(m, token, &op.sa, &op.a, &na);
+		while (ok && (token = strtok(NULL, " "))) {
+			if (strcmp(token, "max") == 0 || strcmp(token, "min") == 0) {
+				char* value = strtok(NULL, " ");
+				ok = value && costNumber(value, token[1] == 'a' ? &op.hi : &op.lo);
+			}
+			else if (!costNumber(token, &op.target)) ok = costOperand(m, token, &op.sb, &op.b, &nb) && nb == na;
 		}
-		else {
-			mju_mulMatVec(res1, *Qm, res0, kMaxState, kMaxState);
-			cost = mju_dot(res0, res1, 2 * dof + quatnum) + R * mju_dot(d->ctrl, d->ctrl, actuatornum);
+		if (!ok) {
+			printf("Invalid cost term: %s\n", model_config->cost[t].c_str());
+			return 0;
 		}
-	}
-	else if (modelid == 3) {
-		mju_sub(res0, state_target, state, 2* dof + quatnum);
-		angleModify(modelid, res0);
-		if (step_index >= stepnum) {
-			mju_mulMatVec(res1, *QTm, res0, kMaxState, kMaxState);
-			cost = mju_dot(res0, res1, 2 * dof + quatnum);
+
+		// a plain sum of squares of a vector is one op, other vector terms give one op per value
+		int r = op.sa == kSrcCtrl;
+		if (na > 1 && op.sb == kSrcZero && op.target == 0 && op.lo == -mjMAXVAL && op.hi == mjMAXVAL) {
+			op.n = na;
+			na = 1;
 		}
+		for (int i = 0; i < na; i++) {
+			CostOp e = op;
+			e.a += i;
+			if (e.sb != kSrcZero) e.b += i;
+			if (phase & 1) group[r].push_back(e);
+			if (phase & 2) group[2 + r].push_back(e);
+		}
+	}
+	for (int g = 0; g < 4; g++) {
+		cost_program.op.insert(cost_program.op.end(), group[g].begin(), group[g].end());
+		cost_program.start[g + 1] = (int)cost_program.op.size();
+	}
+	return 1;
+}
+
+// weighted squared differences of a range of compiled ops
+static mjtNum costSum(const mjtNum* const* src, const CostOp* op, const CostOp* end)
+{
+	mjtNum sum = 0;
+
+	for (; op < end; op++) {
+		const mjtNum* a = src[op->sa] + op->a;
+		if (op->n > 1) sum += op->weight * mju_dot(a, a, op->n);
 		else {
-			mju_mulMatVec(res1, *Qm, res0, kMaxState, kMaxState);
-			cost = mju_dot(res0, res1, 2 * dof + quatnum) + R * mju_dot(d->ctrl, d->ctrl, actuatornum);
+			mjtNum e = a[0] - src[op->sb][op->b] - op->target;
+			e = mjMIN(mjMAX(e, op->lo), op->hi);
+			sum += op->weight * e * e;
 		}
 	}
-	else if (modelid == 2) {
-		if (step_index >= stepnum) cost = (QT * (1 * (d->qpos[0] - 0.6) * (d->qpos[0] - 0.6) + (d->qpos[1] + 0.6) * (d->qpos[1] + 0.6) + 3 * d->qvel[0] * d->qvel[0] + 3 * d->qvel[1] * d->qvel[1]));
-		else cost = (Q * ((1.5 * (d->qpos[0] - 0.6) * (d->qpos[0] - 0.6) + 1.5*(d->qpos[1] + 0.6) * (d->qpos[1] + 0.6))) + R * mju_dot(d->ctrl, d->ctrl, actuatornum));
-	}
-	else if (modelid == 1) {
-		res0[0] = d->qvel[0] - 3;
-		if (res0[0] > 0) res0[0] = 0;
-		if (step_index >= stepnum) cost = (QT * res0[0] * res0[0]);
-		else cost = (Q * res0[0] * res0[0] + R * mju_dot(d->ctrl, d->ctrl, actuatornum));
-	}
-	else if (modelid == 4) {
-		if (step_index >= stepnum) cost = (QT * (1 * (d->site_xpos[6] - d->site_xpos[18]) * (d->site_xpos[6] - d->site_xpos[18]) + 2*(d->site_xpos[8] - d->site_xpos[20]) * (d->site_xpos[8] - d->site_xpos[20]) + 1*mju_dot(d->qvel, d->qvel, m->nv)));
-		else cost = (Q * ((1 * (d->site_xpos[6] - d->site_xpos[18]) * (d->site_xpos[6] - d->site_xpos[18]) + 2 * (d->site_xpos[8] - d->site_xpos[20]) * (d->site_xpos[8] - d->site_xpos[20])) + 0.8*mju_dot(d->qvel, d->qvel, m->nv)) + R * mju_dot(d->ctrl, d->ctrl, actuatornum));
-	}
-	else if (modelid == 5) {
-		if (step_index >= stepnum) cost = (QT * (2 * (d->site_xpos[30] - d->site_xpos[0]) * (d->site_xpos[30] - d->site_xpos[0]) + 5 * (d->site_xpos[32] - d->site_xpos[2]) * (d->site_xpos[32] - d->site_xpos[2]) + 2*mju_dot(d->qvel, d->qvel, m->nv)));
-		else cost = (Q * ((2 * (d->site_xpos[30] - d->site_xpos[0]) * (d->site_xpos[30] - d->site_xpos[0]) + 4 * (d->site_xpos[32] - d->site_xpos[2]) * (d->site_xpos[32] - d->site_xpos[2])) + 0.1*mju_dot(d->qvel, d->qvel, m->nv)) + R * mju_dot(d->ctrl, d->ctrl, actuatornum));
-	}
-	else if (modelid == 6) {
-		if (step_index >= stepnum) cost = (QT * (1 * (d->site_xpos[93] - d->site_xpos[0]) * (d->site_xpos[93] - d->site_xpos[0]) + 5 * (d->site_xpos[95] - d->site_xpos[2]) * (d->site_xpos[95] - d->site_xpos[2]) + 1.2 * mju_dot(d->qvel, d->qvel, m->nv)));
-		else cost = (Q * ((1 * (d->site_xpos[93] - d->site_xpos[0]) * (d->site_xpos[93] - d->site_xpos[0]) + 5 * (d->site_xpos[95] - d->site_xpos[2]) * (d->site_xpos[95] - d->site_xpos[2])) + 1.2*mju_dot(d->qvel, d->qvel, m->nv)) + R * mju_dot(d->ctrl, d->ctrl, actuatornum));
-		//mju_sub(res0, state, state_target, int(statenum / 2));
-		//if (step_index >= stepnum) {
-		//	mju_mulMatVec(res1, *QTm, res0, kMaxState, kMaxState);
-		//	mju_zero(d->ctrl, actuatornum);
-		//}
-		//else mju_mulMatVec(res1, *Qm, res0, kMaxState, kMaxState);
-		//cost = (mju_dot(res0, res1, statenum) + R * mju_dot(d->ctrl, d->ctrl, actuatornum));
-
-		//// point track
-		//if (step_index >= stepnum) cost = (QT * (0.8 * ((d->site_xpos[27] - 2.4) * (d->site_xpos[27] - 2.4)+ (d->site_xpos[36] - 3.58) * (d->site_xpos[36] - 3.58)+ (d->site_xpos[45] - 4.74) * (d->site_xpos[45] - 4.74)+ (d->site_xpos[54] - 5.86) * (d->site_xpos[54] - 5.86) + (d->site_xpos[63] - 6.95) * (d->site_xpos[63] - 6.95) + (d->site_xpos[72] - 7.99) * (d->site_xpos[72] - 7.99) + 1*(d->site_xpos[81] - 8.97) * (d->site_xpos[81] - 8.97) + 1*(d->site_xpos[90] - 9.89) * (d->site_xpos[90] - 9.89) + 1*(d->site_xpos[93] - 10.74) * (d->site_xpos[93] - 10.74)) + 4.5 * ((d->site_xpos[95] - 6.75) * (d->site_xpos[95] - 6.75) + 1*(d->site_xpos[92] - 5.9) * (d->site_xpos[92] - 5.9) + 1*(d->site_xpos[83] - 5.13) * (d->site_xpos[83] - 5.13) + 1*(d->site_xpos[74] - 4.44) * (d->site_xpos[74] - 4.44) + 1*(d->site_xpos[65] - 3.84) * (d->site_xpos[65] - 3.84) + 1.2*(d->site_xpos[56] - 3.33) * (d->site_xpos[56] - 3.33) + 1.5*(d->site_xpos[47] - 2.92) * (d->site_xpos[47] - 2.92) + 1.8*(d->site_xpos[38] - 2.61) * (d->site_xpos[38] - 2.61) + 2*(d->site_xpos[29] - 2.4) * (d->site_xpos[29] - 2.4))) + 0.8 * mju_dot(d->qvel, d->qvel, m->nv));
-		//else cost = (Q * ((0.8 * ((d->site_xpos[27] - 2.4) * (d->site_xpos[27] - 2.4)+ (d->site_xpos[36] - 3.58) * (d->site_xpos[36] - 3.58)+ (d->site_xpos[45] - 4.74) * (d->site_xpos[45] - 4.74) + (d->site_xpos[54] - 5.86) * (d->site_xpos[54] - 5.86) + (d->site_xpos[63] - 6.95) * (d->site_xpos[63] - 6.95) + (d->site_xpos[72] - 7.99) * (d->site_xpos[72] - 7.99) + 1*(d->site_xpos[81] - 8.97) * (d->site_xpos[81] - 8.97) + 1*(d->site_xpos[90] - 9.89) * (d->site_xpos[90] - 9.89) + 1*(d->site_xpos[93] - 10.74) * (d->site_xpos[93] - 10.74)) + 4.5 * ((d->site_xpos[95] - 6.75) * (d->site_xpos[95] - 6.75) + 1*(d->site_xpos[92] - 5.9) * (d->site_xpos[92] - 5.9)+1*(d->site_xpos[83] - 5.13) * (d->site_xpos[83] - 5.13) + 1*(d->site_xpos[74] - 4.44) * (d->site_xpos[74] - 4.44) + 1*(d->site_xpos[65] - 3.84) * (d->site_xpos[65] - 3.84) + 1.2*(d->site_xpos[56] - 3.33) * (d->site_xpos[56] - 3.33) + 1.5*(d->site_xpos[47] - 2.92) * (d->site_xpos[47] - 2.92) + 1.8*(d->site_xpos[38] - 2.61) * (d->site_xpos[38] - 2.61) + 2*(d->site_xpos[29] - 2.4) * (d->site_xpos[29] - 2.4))) + 0.1*mju_dot(d->qvel, d->qvel, m->nv)) + R * mju_dot(d->ctrl, d->ctrl, actuatornum));
-		
-		//// height track
-		//if (step_index >= stepnum) cost = (QT * (0.0 * ((d->site_xpos[27] - 2.4) * (d->site_xpos[27] - 2.4) + (d->site_xpos[36] - 3.58) * (d->site_xpos[36] - 3.58) + (d->site_xpos[45] - 4.74) * (d->site_xpos[45] - 4.74) + (d->site_xpos[54] - 5.86) * (d->site_xpos[54] - 5.86) + (d->site_xpos[63] - 6.95) * (d->site_xpos[63] - 6.95) + (d->site_xpos[72] - 7.99) * (d->site_xpos[72] - 7.99) + 1 * (d->site_xpos[81] - 8.97) * (d->site_xpos[81] - 8.97) + 1 * (d->site_xpos[90] - 9.89) * (d->site_xpos[90] - 9.89) + 1 * (d->site_xpos[93] - 10.74) * (d->site_xpos[93] - 10.74))+ .0 * (d->site_xpos[93] - 12) * (d->site_xpos[93] - 12) + 4. * (0.01*(d->site_xpos[95] - 6.75) * (d->site_xpos[95] - 6.75) + .04 * (d->site_xpos[92] - 5.9) * (d->site_xpos[92] - 5.9) + .1 * (d->site_xpos[83] - 5.13) * (d->site_xpos[83] - 5.13) + .5 * (d->site_xpos[74] - 4.44) * (d->site_xpos[74] - 4.44) + .8 * (d->site_xpos[65] - 3.84) * (d->site_xpos[65] - 3.84) + 1.2*(d->site_xpos[56] - 3.33) * (d->site_xpos[56] - 3.33) + 4*(d->site_xpos[47] - 2.92) * (d->site_xpos[47] - 2.92) + 8*(d->site_xpos[38] - 2.61) * (d->site_xpos[38] - 2.61) + 12 * (d->site_xpos[29] - 2.4) * (d->site_xpos[29] - 2.4))) + 0.2 * mju_dot(d->qvel, d->qvel, m->nv));
-		//else cost = (Q * ((0.0 * ((d->site_xpos[27] - 2.4) * (d->site_xpos[27] - 2.4) + (d->site_xpos[36] - 3.58) * (d->site_xpos[36] - 3.58) + (d->site_xpos[45] - 4.74) * (d->site_xpos[45] - 4.74) + (d->site_xpos[54] - 5.86) * (d->site_xpos[54] - 5.86) + (d->site_xpos[63] - 6.95) * (d->site_xpos[63] - 6.95) + (d->site_xpos[72] - 7.99) * (d->site_xpos[72] - 7.99) + 1 * (d->site_xpos[81] - 8.97) * (d->site_xpos[81] - 8.97) + 1 * (d->site_xpos[90] - 9.89) * (d->site_xpos[90] - 9.89) + 1 * (d->site_xpos[93] - 10.74) * (d->site_xpos[93] - 10.74))+ .0 * (d->site_xpos[93] - 12) * (d->site_xpos[93] - 12) + 4. * (0.01*(d->site_xpos[95] - 6.75) * (d->site_xpos[95] - 6.75) + .04 * (d->site_xpos[92] - 5.9) * (d->site_xpos[92] - 5.9) + .1 * (d->site_xpos[83] - 5.13) * (d->site_xpos[83] - 5.13) + .5 * (d->site_xpos[74] - 4.44) * (d->site_xpos[74] - 4.44) + .8 * (d->site_xpos[65] - 3.84) * (d->site_xpos[65] - 3.84) + 1.2*(d->site_xpos[56] - 3.33) * (d->site_xpos[56] - 3.33) + 4*(d->site_xpos[47] - 2.92) * (d->site_xpos[47] - 2.92) + 8*(d->site_xpos[38] - 2.61) * (d->site_xpos[38] - 2.61) + 12 * (d->site_xpos[29] - 2.4) * (d->site_xpos[29] - 2.4))) + 0.2*mju_dot(d->qvel, d->qvel, m->nv)) + R * mju_dot(d->ctrl, d->ctrl, actuatornum));
-	}
-	else if (modelid == 7) {
-		if (step_index >= stepnum) cost = (QT * (1 * (d->qpos[0] - d->site_xpos[0]) * (d->qpos[0] - d->site_xpos[0]) + 1 * (d->qpos[1] - d->site_xpos[1]) * (d->qpos[1] - d->site_xpos[1]) + 0.0 * mju_dot(d->qvel, d->qvel, m->nv)));
-		else cost = (Q * ((1 * (d->qpos[0] - d->site_xpos[0]) * (d->qpos[0] - d->site_xpos[0]) + 1 * (d->qpos[1] - d->site_xpos[1]) * (d->qpos[1] - d->site_xpos[1])) + 0.00*mju_dot(d->qvel, d->qvel, m->nv)) + R * mju_dot(d->ctrl, d->ctrl, actuatornum));
-	}
-	else if (modelid == 8) {
-		//if (step_index >= stepnum) cost = (QT * (1 * (d->site_xpos[15] - d->site_xpos[33]) * (d->site_xpos[15] - d->site_xpos[33]) + 1 * (d->site_xpos[17] - d->site_xpos[35]) * (d->site_xpos[17] - d->site_xpos[35]) + .5* mju_dot(d->qvel, d->qvel, m->nv)));
-		//else cost = (Q * ((1 * (d->site_xpos[15] - d->site_xpos[33]) * (d->site_xpos[15] - d->site_xpos[33]) + 1 * (d->site_xpos[17] - d->site_xpos[35]) * (d->site_xpos[17] - d->site_xpos[35])) + 0.4*mju_dot(d->qvel, d->qvel, m->nv)) + R * mju_dot(d->ctrl, d->ctrl, actuatornum));
-		if (step_index >= stepnum) cost = (QT * (1.2 * (d->site_xpos[15] - d->site_xpos[33]) * (d->site_xpos[15] - d->site_xpos[33]) + 1 * (d->site_xpos[17] - d->site_xpos[35]) * (d->site_xpos[17] - d->site_xpos[35]) + 0.8* mju_dot(d->qvel, d->qvel, m->nv)));
-		else cost = (Q * ((1.2 * (d->site_xpos[15] - d->site_xpos[33]) * (d->site_xpos[15] - d->site_xpos[33]) + 1 * (d->site_xpos[17] - d->site_xpos[35]) * (d->site_xpos[17] - d->site_xpos[35])) + 0.5*mju_dot(d->qvel, d->qvel, m->nv)) + R * mju_dot(d->ctrl, d->ctrl, actuatornum));
-	}					 
-	else if (modelid == 9) {
-		// original
-		//if (step_index >= stepnum) cost = (QT * (1 * (d->site_xpos[33] - d->site_xpos[63]) * (d->site_xpos[33] - d->site_xpos[63]) + 1.8 * (d->site_xpos[35] - d->site_xpos[65]) * (d->site_xpos[35] - d->site_xpos[65]) + 1 * mju_dot(d->qvel, d->qvel, m->nv)));
-		//else cost = (Q * ((1 * (d->site_xpos[33] - d->site_xpos[63]) * (d->site_xpos[33] - d->site_xpos[63]) + 1.8 * (d->site_xpos[35] - d->site_xpos[65]) * (d->site_xpos[35] - d->site_xpos[65])) + 0.8*mju_dot(d->qvel, d->qvel, m->nv)) + R * mju_dot(d->ctrl, d->ctrl, actuatornum));
-		// big vel cost
-		//if (step_index >= stepnum) cost = (QT * (1 * (d->site_xpos[33] - d->site_xpos[63]) * (d->site_xpos[33] - d->site_xpos[63]) + 1.5 * (d->site_xpos[35] - d->site_xpos[65]) * (d->site_xpos[35] - d->site_xpos[65]) + .8 * mju_dot(d->qvel, d->qvel, m->nv)));
-		//else cost = (Q * ((1 * (d->site_xpos[33] - d->site_xpos[63]) * (d->site_xpos[33] - d->site_xpos[63]) + 1.5 * (d->site_xpos[35] - d->site_xpos[65]) * (d->site_xpos[35] - d->site_xpos[65])) + 0.00*mju_dot(d->qvel, d->qvel, m->nv)) + R * mju_dot(d->ctrl, d->ctrl, actuatornum));
-		// small vel cost
-		if (step_index >= stepnum) cost = (QT * (1 * (d->site_xpos[33] - d->site_xpos[63]) * (d->site_xpos[33] - d->site_xpos[63]) + 1.5 * (d->site_xpos[35] - d->site_xpos[65]) * (d->site_xpos[35] - d->site_xpos[65]) + .01 * mju_dot(d->qvel, d->qvel, m->nv)));
-		else cost = (Q * ((1 * (d->site_xpos[33] - d->site_xpos[63]) * (d->site_xpos[33] - d->site_xpos[63]) + 1.5 * (d->site_xpos[35] - d->site_xpos[65]) * (d->site_xpos[35] - d->site_xpos[65])) + 0.00*mju_dot(d->qvel, d->qvel, m->nv)) + R * mju_dot(d->ctrl, d->ctrl, actuatornum));
-	}
-	else if (modelid == 10) {
-		if (step_index >= stepnum) cost = (QT * (120 * (2 * (d->geom_xpos[11] - d->geom_xpos[5]) * (d->geom_xpos[11] - d->geom_xpos[5]) + (d->geom_xpos[10] - d->geom_xpos[4]) * (d->geom_xpos[10] - d->geom_xpos[4]) + (d->geom_xpos[9] - d->geom_xpos[3]) * (d->geom_xpos[9] - d->geom_xpos[3])) + (d->xmat[17] - 1) * (d->xmat[17] - 1)) + R * mju_dot(d->ctrl, d->ctrl, actuatornum));
-		else cost = (Q * (120 * (2 * (d->geom_xpos[11] - d->geom_xpos[5]) * (d->geom_xpos[11] - d->geom_xpos[5]) + (d->geom_xpos[10] - d->geom_xpos[4]) * (d->geom_xpos[10] - d->geom_xpos[4]) + 1.2*(d->geom_xpos[9] - d->geom_xpos[3]) * (d->geom_xpos[9] - d->geom_xpos[3])) + (d->xmat[17] - 1) * (d->xmat[17] - 1)) + R * mju_dot(d->ctrl, d->ctrl, actuatornum));
-	}
-	else if (modelid == 11) {
-		if (step_index >= stepnum) cost = (QT * (1 * (d->site_xpos[3] - d->site_xpos[12]) * (d->site_xpos[3] - d->site_xpos[12]) + 1. * (d->site_xpos[4] - d->site_xpos[13]) * (d->site_xpos[4] - d->site_xpos[13]) + 1.5 * (d->site_xpos[5] - d->site_xpos[14]) * (d->site_xpos[5] - d->site_xpos[14]) + .08 * mju_dot(d->qvel, d->qvel, m->nv)));
-		else cost = (Q * (1 * (d->site_xpos[3] - d->site_xpos[12]) * (d->site_xpos[3] - d->site_xpos[12]) + 1. * (d->site_xpos[4] - d->site_xpos[13]) * (d->site_xpos[4] - d->site_xpos[13]) + 1.5 * (d->site_xpos[5] - d->site_xpos[14]) * (d->site_xpos[5] - d->site_xpos[14]) + 0.01*mju_dot(d->qvel, d->qvel, m->nv)) + R * mju_dot(d->ctrl, d->ctrl, actuatornum));
-	}
-	else if (modelid == 12) {
-		if (step_index >= stepnum) cost = (QT * (1 * (d->site_xpos[3] - d->site_xpos[15]) * (d->site_xpos[3] - d->site_xpos[15]) + 1. * (d->site_xpos[4] - d->site_xpos[16]) * (d->site_xpos[4] - d->site_xpos[16]) + 1.5 * (d->site_xpos[5] - d->site_xpos[17]) * (d->site_xpos[5] - d->site_xpos[17]) + 1 * mju_dot(d->qvel, d->qvel, m->nv)));
-		else cost = (Q * (1 * (d->site_xpos[3] - d->site_xpos[15]) * (d->site_xpos[3] - d->site_xpos[15]) + 1. * (d->site_xpos[4] - d->site_xpos[16]) * (d->site_xpos[4] - d->site_xpos[16]) + 1.5 * (d->site_xpos[5] - d->site_xpos[17]) * (d->site_xpos[5] - d->site_xpos[17]) + 0.6*mju_dot(d->qvel, d->qvel, m->nv)) + R * mju_dot(d->ctrl, d->ctrl, actuatornum));
-	}
-	else if (modelid == 13) {
-		if (step_index >= stepnum) cost = (QT * (1 * (d->qpos[0] - 0.6) * (d->qpos[0] - 0.6) + (d->qpos[1] + 0.6) * (d->qpos[1] + 0.6) + 3 * d->qvel[0] * d->qvel[0] + 3 * d->qvel[1] * d->qvel[1]) + R * mju_dot(d->ctrl, d->ctrl, actuatornum));
-		else cost = (Q * ((1 * (d->qpos[0] - 0.6) * (d->qpos[0] - 0.6) + 1*(d->qpos[1] + 0.6) * (d->qpos[1] + 0.6))) + R * mju_dot(d->ctrl, d->ctrl, actuatornum));
-	}
-	else if (modelid == 14) {
-		if (step_index >= stepnum) cost = (QT * (1 * (d->site_xpos[12] - d->site_xpos[33]) * (d->site_xpos[12] - d->site_xpos[33]) + 1. * (d->site_xpos[13] - d->site_xpos[34]) * (d->site_xpos[13] - d->site_xpos[34]) + 1.5 * (d->site_xpos[14] - d->site_xpos[35]) * (d->site_xpos[14] - d->site_xpos[35]) + .1 * mju_dot(d->qvel, d->qvel, m->nv)));
-		else cost = (Q * (1 * (d->site_xpos[12] - d->site_xpos[33]) * (d->site_xpos[12] - d->site_xpos[33]) + 1. * (d->site_xpos[13] - d->site_xpos[34]) * (d->site_xpos[13] - d->site_xpos[34]) + 1.5 * (d->site_xpos[14] - d->site_xpos[35]) * (d->site_xpos[14] - d->site_xpos[35]) + 0.01*mju_dot(d->qvel, d->qvel, m->nv)) + R * mju_dot(d->ctrl, d->ctrl, actuatornum));
-	}
-	else if (modelid == 15) {
-		mju_sub(res0, state_target, state, 2 * dof + quatnum);
-		angleModify(modelid, res0);
+	return sum;
+}
+
+// return the cost value at the given step
+mjtNum stepCost(mjModel* /*m*/, mjData* d, int step_index, const CostConfig* c)
+{
+	// compiled cost terms of the model config, before any scratch vector is cleared
+	if (!cost_program.op.empty()) {
+		const mjtNum* src[kCostSource] = { d->qpos, d->qvel, d->ctrl, d->site_xpos, d->geom_xpos, d->xpos, d->xmat, d->sensordata, cost_zero };
+		const CostOp* op = cost_program.op.data();
+		const int* g = cost_program.start + (step_index >= stepnum ? 2 : 0);
+
+		return (step_index >= stepnum ? c->QT : c->Q) * costSum(src, op + g[0], op + g[1]) + c->R * costSum(src, op + g[1], op + g[2]);
+	}
+	if (model_kernel && model_kernel->cost) return model_kernel->cost(d, step_index, c);
+
+	// quadratic state cost with angle wrapping
+	mjtNum state[kMaxState], res0[kMaxState] = { 0 }, res1[kMaxState] = { 0 }, cost = 0;
+
+	mju_copy(state, d->qpos, dof + quatnum);
+	mju_copy(&state[dof + quatnum], d->qvel, dof);
+	if (modelid == 0 || modelid == 3 || modelid == 15) {
+		mju_sub(res0, c->target, state, 2*dof + quatnum);
+		angleModify(modelid, res0, c->target);
 		if (step_index >= stepnum) {
-			mju_mulMatVec(res1, *QTm, res0, kMaxState, kMaxState);
+			mju_mulMatVec(res1, c->QTm, res0, statedim, statedim);
 			cost = mju_dot(res0, res1, 2 * dof + quatnum);
 		}
 		else {
-			mju_mulMatVec(res1, *Qm, res0, kMaxState, kMaxState);
-			cost = mju_dot(res0, res1, 2 * dof + quatnum) + R * mju_dot(d->ctrl, d->ctrl, actuatornum);
+			mju_mulMatVec(res1, c->Qm, res0, statedim, statedim);
+			cost = mju_dot(res0, res1, 2 * dof + quatnum) + c->R * mju_dot(d->ctrl, d->ctrl, actuatornum);
 		}
 	}
-	else if (modelid == 16) {
-		if (step_index >= stepnum) cost = QT * (1 * (d->site_xpos[48] - d->site_xpos[75]) * (d->site_xpos[48] - d->site_xpos[75]) + 1. * (d->site_xpos[49] - d->site_xpos[76]) * (d->site_xpos[49] - d->site_xpos[76]) + 1.5 * (d->site_xpos[50] - d->site_xpos[77]) * (d->site_xpos[50] - d->site_xpos[77]) + .01 * mju_dot(d->sensordata, d->sensordata, 3*nodenum)); //0.08 vel
-		else cost = Q * (1 * (d->site_xpos[48] - d->site_xpos[75]) * (d->site_xpos[48] - d->site_xpos[75]) + 1. * (d->site_xpos[49] - d->site_xpos[76]) * (d->site_xpos[49] - d->site_xpos[76]) + 1.5 * (d->site_xpos[50] - d->site_xpos[77]) * (d->site_xpos[50] - d->site_xpos[77]) + 0.00*mju_dot(d->sensordata, d->sensordata, 3*nodenum)) + R * mju_dot(d->ctrl, d->ctrl, actuatornum);
-	}
-	else if (modelid == 17) {
-		if (step_index >= stepnum) cost = (QT * (1 * (d->qpos[0] - 0.7) * (d->qpos[0] - 0.7) + (d->qpos[1] - 0.7) * (d->qpos[1] - 0.7) + .00 * mju_dot(d->qvel, d->qvel, m->nv)));
-		else cost = (Q * (1 * (d->qpos[0] - 0.7) * (d->qpos[0] - 0.7) + 1 * (d->qpos[1] - 0.7) * (d->qpos[1] - 0.7) + .0000 * mju_dot(d->qvel, d->qvel, m->nv)) + R * mju_dot(d->ctrl, d->ctrl, actuatornum));
-	}
 	return cost;
 }
 
+mjtNum stepCost(mjModel* m, mjData* d, int step_index)
+{
+	CostConfig config = { Q, QT, R, Qm.data, QTm.data, state_target };
+
+	return stepCost(m, d, step_index, &config);
+}
+
 // simulate and record the nominal trajectory
 void stateNominal(mjModel* m, mjData* d)
 {
@@ -610,8 +871,7 @@ void stateNominal(mjModel* m, mjData* d)
 	}
 	for (int step_index = 0; step_index < stepnum; step_index++) {
 		mju_copy(d->ctrl, &ctrl_nominal[step_index * actuatornum], actuatornum);
-		for (int i = 0; i < integration_per_step; i++) mj_step(m, d);
-		mj_forward(m, d);
+		controlStep(m, d);
 
 		if (modelid == 11 || modelid == 14 || modelid == 16) {
 			mju_copy(state_nominal[step_index + 1], d->site_xpos, 3 * nodenum);
@@ -633,6 +893,60 @@ void stateNominal(mjModel* m, mjData* d)
 	mj_forward(m, d);
 }
 
+int readResult(const char* filename, mjtNum* ctrl, int maxnum, mjtNum* dt, int* nstep)
+{
+	FILE *fop;
+	char buff[100];
+	int num = 0;
+
+	if ((fop = fopen(filename, "r")) == NULL) return -1;
+	*dt = 0;
+	*nstep = 0;
+	while (fscanf(fop, "%99s", buff) == 1 && buff[0] != '/') {
+		if (num < maxnum) ctrl[num] = atof(buff);
+		num++;
+	}
+	while (fscanf(fop, "%99s", buff) == 1) {
+		if (strcmp(buff, "ctrl_step:") == 0 && fscanf(fop, "%99s", buff) == 1) *dt = atof(buff);
+		else if (strcmp(buff, "step_num:") == 0 && fscanf(fop, "%99s", buff) == 1) *nstep = atoi(buff);
+	}
+	fclose(fop);
+	return mjMIN(num, maxnum);
+}
+
+void ctrlResample(mjtNum* dst, int dststep, mjtNum dstdt, const mjtNum* src, int srcstep, mjtNum srcdt, int nact, int spline)
+{
+	mjtNum *second = new mjtNum[srcstep], *diag = new mjtNum[srcstep];
+
+	for (int a = 0; a < nact; a++) {
+		// second derivatives of the natural cubic spline through the step midpoints, tridiagonal solve
+		mju_zero(second, srcstep);
+		if (spline && srcstep > 2) {
+			for (int k = 1; k < srcstep - 1; k++) {
+				mjtNum rhs = 6 * (src[(k + 1) * nact + a] - 2 * src[k * nact + a] + src[(k - 1) * nact + a]) / (srcdt * srcdt);
+				mjtNum sub = k > 1 ? 1 / diag[k - 1] : 0;
+				diag[k] = 4 - sub;
+				second[k] = rhs - sub * second[k - 1];
+			}
+			for (int k = srcstep - 2; k >= 1; k--)
+				second[k] = (second[k] - (k < srcstep - 2 ? second[k + 1] : 0)) / diag[k];
+		}
+
+		for (int j = 0; j < dststep; j++) {
+			mjtNum x = ((j + 0.5) * dstdt) / srcdt - 0.5;
+			if (x <= 0) { dst[j * nact + a] = src[a]; continue; }
+			if (x >= srcstep - 1) { dst[j * nact + a] = src[(srcstep - 1) * nact + a]; continue; }
+			int k = (int)x;
+			mjtNum t = x - k;
+			mjtNum y0 = src[k * nact + a], y1 = src[(k + 1) * nact + a];
+			dst[j * nact + a] = (1 - t) * y0 + t * y1
+				- t * (1 - t) * srcdt * srcdt / 6 * ((2 - t) * second[k] + (1 + t) * second[k + 1]);
+		}
+	}
+	delete[] second;
+	delete[] diag;
+}
+
 /**
 * @brief  Read parameters from a file stream
 * @note   none
@@ -22,6 +22,9 @@
 #include <chrono>
 #include <math.h>
 #include <time.h>
+#include <stdint.h>
+#include <vector>
+#include <unordered_map>
 #include "Eigen/LU"
 #include <iostream>
 
@@ -34,6 +37,80 @@ const int N = 4;
 const int N1 = 30;
 const mjtNum PI = 3.141592653;
 
+/* Exported types -----------------------------------------------------------*/
+
+// counter-based random stream (Philox4x32-10): the output only depends on (key, counter)
+struct RandStream
+{
+	uint32_t key[2];                // seed
+	uint32_t ctr[4];                // ctr[0..1]: block index, ctr[2..3]: stream id
+};
+
+// weights and target of the step cost, the global Q, QT, R, Qm, QTm and state_target are one configuration
+struct CostConfig
+{
+	mjtNum Q, QT, R;
+	const mjtNum* Qm;               // statedim x statedim
+	const mjtNum* QTm;              // statedim x statedim
+	const mjtNum* target;           // state target
+};
+
+// one term of a compiled cost: weight * clamp(src[sa][a] - src[sb][b] - target, lo, hi)^2,
+// or for n > 1 weight times the sum of squares of the n values from src[sa][a]
+struct CostOp
+{
+	int sa, a;                      // source array and index of the first operand
+	int sb, b;                      // source array and index of the second operand, the zero source if absent
+	int n;                          // number of values of a plain sum of squares, 1 otherwise
+	mjtNum weight, target;
+	mjtNum lo, hi;                  // clamp of the difference for one-sided terms, -mjMAXVAL and mjMAXVAL otherwise
+};
+
+// cost terms of the config compiled for the loaded model, evaluated instead of the modelid branches of stepCost
+struct CostProgram
+{
+	vector<CostOp> op;              // running Q, running R, terminal QT and terminal R terms in this order
+	int start[5] = { 0 };           // first op of each group, start[4] is the op count
+};
+
+// cost and feedback kernels compiled for the fixed dimensions of one model, see kernelSelect
+struct ModelKernel
+{
+	const char* name;               // model of the config
+	int id, nq, nv, nu;             // model id, dof+quatnum, dof and actuatornum of the instantiation
+	mjtNum (*cost)(const mjData* d, int step_index, const CostConfig* c);   // NULL: compiled cost terms
+	void (*feedback)(const mjData* d, mjtNum* ctrl);                        // stabilizer gain times the state error
+};
+
+// row-major matrix in a 64-byte aligned buffer, a[i] is row i
+struct AlignedMatrix
+{
+	mjtNum* data = NULL;
+	int rows = 0;
+	int cols = 0;
+	mjtNum* operator[](int row) const { return data + (size_t)row * cols; }
+};
+
+// settings of one model, read from the model config file next to its xml
+struct ModelConfig
+{
+	int id = -1;                    // model id of the cost and angle functions
+	mjtNum control_timestep = 0;
+	mjtNum simulation_timestep = 0;
+	int stepnum = 0;
+	int rolloutnum_train = 1;
+	int nodenum = 0;
+	int dof = 0;                    // 0: nv of the loaded model
+	int quatnum = -1;               // -1: nq - nv of the loaded model
+	int actuatornum = 0;            // 0: nu of the loaded model
+	mjtNum ctrl_upperlimit = 100;
+	mjtNum ctrl_lowerlimit = -100;
+	vector<mjtNum> state_init;      // leading entries of the initial state, the rest is zero
+	vector<mjtNum> state_target;    // leading entries of the target state, the rest is zero
+	vector<mjtNum> feedback_gain;   // actuatornum x (2*dof+quatnum) stabilizer gain, row major
+	vector<string> cost;            // tokens of each "cost:" term, separated by spaces
+};
+
 /* Exported functions ------------------------------------------------------- */
 /**
 * @brief  Read data from .mat file
@@ -76,9 +153,20 @@ void terminalCtrl(mjModel* m, mjData* d, int step_index);
 */
 void modelInit(mjModel* m, mjData* d, mjtNum* state_init);
 
+/**
+* @brief  Simulate one control step of integration_per_step physics steps
+* @note   the position and velocity stages of the current state must be computed (modelInit, mj_forward or controlStep),
+*		  they are left computed for the new state, so site_xpos and sensordata can be used without mj_forward.
+*		  With the Euler integrator the first physics step reuses them through mj_step2.
+* @param  mjModel* m: model
+*         mjData* d: data
+* @retval none
+*/
+void controlStep(const mjModel* m, mjData* d);
+
 /**
 * @brief  Generate Gaussian random value
-* @note   none
+* @note   thread-safe, draws from the stream of the calling thread set by randSeed
 * @param  mjtNum mean: mean
 *         mjtNum var: variance
 * @retval mjtNum: Gaussian random value
@@ -87,7 +175,7 @@ mjtNum randGauss(mjtNum mean, mjtNum var);
 
 /**
 * @brief  Generate iid Gaussian random vector
-* @note   none
+* @note   thread-safe, draws from the stream of the calling thread set by randSeed
 * @param  mjtNum mean: mean
 *         mjtNum var: variance
 *         int n: vector size
@@ -95,6 +183,111 @@ mjtNum randGauss(mjtNum mean, mjtNum var);
 */
 mjtNum *randGauss(mjtNum mean, mjtNum var, int n);
 
+/**
+* @brief  Seed the random stream used by randGauss in the calling thread
+* @note   replaces srand(), every thread has its own stream
+* @param  uint64_t seed: seed
+*         uint32_t stream: stream id, e.g. the thread id
+* @retval none
+*/
+void randSeed(uint64_t seed, uint32_t stream = 0);
+
+/**
+* @brief  Initialize a counter-based random stream
+* @note   streams with different (stream0, stream1) are independent, so the noise of
+*         e.g. (iteration, rollout) does not depend on which thread draws it
+* @param  RandStream* s: stream
+*         uint64_t seed: seed
+*         uint32_t stream0, stream1: stream id
+* @retval none
+*/
+void randStreamInit(RandStream* s, uint64_t seed, uint32_t stream0, uint32_t stream1 = 0);
+
+/**
+* @brief  Jump ahead in a random stream
+* @note   one block gives 2 Gaussian values
+* @param  RandStream* s: stream
+*         uint64_t nblock: number of blocks to skip
+* @retval none
+*/
+void randStreamSkip(RandStream* s, uint64_t nblock);
+
+/**
+* @brief  Fill an array with iid Gaussian random values
+* @note   Box-Muller on 53-bit uniforms, both outputs of every pair are used
+* @param  RandStream* s: stream, advanced by ceil(n/2) blocks
+*         mjtNum* res: output array
+*         int n: array length
+*         mjtNum mean: mean
+*         mjtNum var: variance
+* @retval none
+*/
+void randGaussFill(RandStream* s, mjtNum* res, int n, mjtNum mean = 0, mjtNum var = 1);
+
+/**
+* @brief  Inverse of the standard normal CDF
+* @param  mjtNum p: probability in (0, 1)
+* @retval mjtNum: quantile
+*/
+mjtNum normalInv(mjtNum p);
+
+/**
+* @brief  Number of Sobol chunks needed for a vector
+* @note   long vectors are split into chunks of 32 dimensions that reuse the same Sobol dimensions
+* @param  int n: vector size
+* @retval int: chunk number
+*/
+int sobolChunkNum(int n);
+
+/**
+* @brief  Random order of the Sobol points in every chunk
+* @note   decorrelates the chunks (Latin supercube sampling), uses stream1 >= 2^31 of (seed, stream)
+* @param  uint64_t seed: seed
+*         uint32_t stream: stream id, e.g. the iteration
+*         int* order: output, npoint*nchunk point indices, chunk-major
+*         int npoint: point number of the batch
+*         int nchunk: chunk number
+* @retval none
+*/
+void sobolPointOrder(uint64_t seed, uint32_t stream, int* order, int npoint, int nchunk);
+
+/**
+* @brief  Fill an array with one scrambled Sobol point mapped to the Gaussian
+* @note   Owen scrambling keyed by (seed, stream, chunk), the npoint points of a batch are
+*         stratified in every dimension, best with npoint a power of 2
+* @param  uint64_t seed: seed
+*         uint32_t stream: stream id, must match sobolPointOrder
+*         const int* order: point order from sobolPointOrder
+*         int npoint: point number of the batch
+*         int point: point index in [0, npoint)
+*         mjtNum* res: output array
+*         int n: array length
+*         mjtNum mean: mean
+*         mjtNum var: variance
+* @retval none
+*/
+void sobolGaussFill(uint64_t seed, uint32_t stream, const int* order, int npoint, int point, mjtNum* res, int n, mjtNum mean = 0, mjtNum var = 1);
+
+/**
+* @brief  Clamped uniform cubic B-spline basis sampled at every control step
+* @note   the basis functions sum to 1 at every step
+* @param  mjtNum* res: output, nstep x nbasis row-major
+*         int nstep: step number
+*         int nbasis: basis function number, at least 4
+* @retval none
+*/
+void bsplineBasis(mjtNum* res, int nstep, int nbasis);
+
+/**
+* @brief  Truncated DCT-II basis sampled at every control step
+* @note   cos(pi*k*(s+0.5)/nstep) with unit amplitude, k = 0 is the constant
+* @param  mjtNum* res: output, nstep x nbasis row-major
+*         int nstep: step number
+*         int nbasis: basis function number
+* @retval none
+*/
+void dctBasis(mjtNum* res, int nstep, int nbasis);
+
 /**
 * @brief  Apply limit to control values
 * @note   none
@@ -104,6 +297,18 @@ mjtNum *randGauss(mjtNum mean, mjtNum var, int n);
 */
 void ctrlLimit(mjtNum* ctrl, int num);
 
+/**
+* @brief  Subtract a clipped update from the controls and apply the control limit, in one vectorized pass
+* @note   every update value is scale*step clipped to [-maxstep, maxstep]
+* @param  mjtNum ctrl: control vector
+*		  mjtNum step: update vector
+*		  mjtNum scale: update scale
+*		  mjtNum maxstep: max update per control value
+*		  int num: control vector length
+* @retval none
+*/
+void ctrlStep(mjtNum* ctrl, const mjtNum* step, mjtNum scale, mjtNum maxstep, int num);
+
 /**
 * @brief  Angle modification for pendulum, cartpole and acrobot to clamp angle value
 * @note   different modification different model
@@ -113,6 +318,16 @@ void ctrlLimit(mjtNum* ctrl, int num);
 */
 void angleModify(int modelid, mjtNum* state_error);
 
+/**
+* @brief  Angle modification for pendulum, cartpole and acrobot to clamp angle value
+* @note   same as above with the given state target instead of state_target
+* @param  int model: id of the model
+*         mjtNum* state_error: target - qpos, will be updated in the function
+*         const mjtNum* target: state target
+* @retval none
+*/
+void angleModify(int modelid, mjtNum* state_error, const mjtNum* target);
+
 /**
 * @brief  Angle modification for pendulum, cartpole and acrobot to clamp angle value
 * @note   different modification different model
@@ -123,14 +338,94 @@ void angleModify(int modelid, mjtNum* state_error);
 */
 mjtNum angleModify(int modelid, mjtNum angle, int index = 0);
 
+/**
+* @brief  Read a model config file into the model registry
+* @note   the file holds "key: value" pairs, the vector keys take all numbers up to the next key,
+*		  the model name is the file name without directory and .cfg
+* @param  const char* filename: path of the .cfg file
+* @retval int: 1 is succeed, 0 is fail to read the file
+*/
+int modelRegister(const char* filename);
+
+/**
+* @brief  Find a model in the model registry
+* @note   the name is not case sensitive
+* @param  const char* model: model name
+* @retval const ModelConfig*: settings of the model, NULL if it is not registered
+*/
+const ModelConfig* modelLookup(const char* model);
+
 /**
 * @brief  Select model parameters set
-* @note   none
-* @param  const char* model: name of the model whose parameters to select
+* @note   a model that is not registered yet is read from name.cfg in the directory of the last model path given,
+*		  then from model/name.cfg. The dimensions are set by modelDimension once the model is loaded.
+* @param  const char* model: name of the model whose parameters to select, or the model file path without extension
 * @retval int: 1 is succeed, 0 is fail to set the parameters
 */
 int modelSelection(const char* model);
 
+/**
+* @brief  Set the dimensions of the selected model from the loaded mjModel and allocate the problem storage
+* @note   dof, quatnum and actuatornum are nv, nq - nv and nu unless the config gives them, a warning is printed
+*		  if only one of dof and quatnum is given and the other disagrees with the model.
+*		  state_nominal, the control sequences, the target, the gain and Qm/QTm are sized for these and stepnum,
+*		  so stepnum has to be set before and may only decrease afterwards. The initial state, target and
+*		  feedback gain of the config are then copied.
+* @param  const mjModel* m: loaded model
+* @retval int: 1 is succeed, 0 if no model is selected, a dimension exceeds kMaxState or the allocation fails
+*/
+int modelDimension(const mjModel* m);
+
+/**
+* @brief  Compile the "cost:" terms of the selected model into the flat op array evaluated by stepCost
+* @note   a term is "cost: running|terminal|both weight operand [operand] [target] [max value] [min value]"
+*		  and adds weight * (operand - operand - target)^2, clamped to at most max or at least min. An operand is
+*		  qpos, qvel, ctrl or sensordata with an optional index or range i-j (the whole vector without),
+*		  joint:name, jointvel:name, sensor:name[:k], site:name:c, geom:name:c, body:name:c with c = x|y|z,
+*		  or xmat:body:k with k = 0..8. Names may also be ids. Terms of ctrl are scaled by R, the others by
+*		  Q or QT. Without terms stepCost keeps the modelid branches. Called by modelDimension.
+* @param  const mjModel* m: loaded model
+* @retval int: 1 is succeed, 0 if a term cannot be compiled
+*/
+int costCompile(const mjModel* m);
+
+/**
+* @brief  Select the fixed-dimension cost and feedback kernels of the selected model
+* @note   a kernel of model_kernels is used when the model id, dof, quatnum and actuatornum match its instantiation,
+*		  stepCost and terminalCtrl take the generic path otherwise. Compiled cost terms take precedence over a
+*		  kernel cost. Called by modelDimension with fixed = 1.
+* @param  const mjModel* m: loaded model
+*         int fixed: 0 forces the generic path
+* @retval int: 1 if a fixed-dimension kernel is selected, 0 otherwise
+*/
+int kernelSelect(const mjModel* m, int fixed);
+
+/**
+* @brief  Allocate a zeroed buffer starting on a 64-byte boundary
+* @note   free it with alignedFree
+* @param  size_t num: number of values
+* @retval mjtNum*: the buffer, NULL if the allocation fails
+*/
+mjtNum* alignedAlloc(size_t num);
+
+/**
+* @brief  Free a buffer of alignedAlloc
+* @note   NULL is ignored
+* @param  mjtNum* ptr: buffer
+* @retval none
+*/
+void alignedFree(mjtNum* ptr);
+
+/**
+* @brief  Reallocate a matrix with new dimensions
+* @note   the previous values are dropped, the new matrix is zero
+* @param  AlignedMatrix* a: matrix
+*         int rows: row number
+*         int cols: column number
+* @retval none
+*/
+void matrixResize(AlignedMatrix* a, int rows, int cols);
+
 /**
 * @brief  calculate the cost at a step
 * @note   none
@@ -141,6 +436,17 @@ int modelSelection(const char* model);
 */
 mjtNum stepCost(mjModel* m, mjData* d, int step_index);
 
+/**
+* @brief  calculate the cost at a step under a given cost configuration
+* @note   thread-safe, one simulated step can be scored under several configurations
+* @param  mjData* d: mujoco simulation data at the specific step
+		  mjModel* m: mujoco model
+		  int step_index: the step number whose cost needs calculation
+		  const CostConfig* c: weights and state target
+* @retval mjtNum: cost value at the specific step
+*/
+mjtNum stepCost(mjModel* m, mjData* d, int step_index, const CostConfig* c);
+
 /**
 * @brief  simulate one rollout with nominal control to calculate the nominal states
 * @note   none
@@ -150,6 +456,35 @@ mjtNum stepCost(mjModel* m, mjData* d, int step_index);
 */
 void stateNominal(mjModel* m, mjData* d);
 
+/**
+* @brief  Read the controls and their timing from an openloop result file
+* @note   the controls are the values before the LOG section, dt and nstep come from
+*         "ctrl_step:" and "step_num:" in the LOG
+* @param  const char* filename: result file, e.g. result0.txt
+*         mjtNum* ctrl: output controls
+*         int maxnum: size of ctrl
+*         mjtNum* dt: output control timestep
+*         int* nstep: output step number
+* @retval int: number of control values read, -1 if the file could not be read
+*/
+int readResult(const char* filename, mjtNum* ctrl, int maxnum, mjtNum* dt, int* nstep);
+
+/**
+* @brief  Resample a control sequence onto a new control timestep and horizon
+* @note   every control is held over its step and sampled at the step midpoint,
+*         beyond the source horizon the last control is held
+* @param  mjtNum* dst: output, dststep x nact
+*         int dststep: output step number
+*         mjtNum dstdt: output control timestep
+*         const mjtNum* src: source, srcstep x nact
+*         int srcstep: source step number
+*         mjtNum srcdt: source control timestep
+*         int nact: actuator number
+*         int spline: 0: linear, 1: natural cubic spline interpolation
+* @retval none
+*/
+void ctrlResample(mjtNum* dst, int dststep, mjtNum dstdt, const mjtNum* src, int srcstep, mjtNum srcdt, int nact, int spline);
+
 void save_result(const char *_filename, mjtNum *u, mjtNum *u_init, mjtNum len, mjtNum *Q, mjtNum *QT, mjtNum *R, mjtNum *ptb_coef, mjtNum *step_coef, mjtNum ns, const char *_mode = "wt+");
 void fw_array(FILE *fstream, mjtNum *prt, mjtNum len = 1, const char *_name = "Array1: ");
 void fw_array(const char *_filename, mjtNum *prt, mjtNum len = 1, const char *_name = "Array1: ", const char *_mode = "wt+");
@@ -0,0 +1,180 @@
+/*  Copyright  2018, Roboti LLC
+
+    This file is licensed under the MuJoCo Resource License (the "License").
+    You may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        https://www.roboti.us/resourcelicense.txt
+*/
+
+#include <windows.h>
+#include "funclib.h"
+
+//-------------------------------- global variables -------------------------------------
+// constants
+extern const int kMaxState = 160;	// max (state dimension, actuator number)
+
+// extern model specific parameters
+extern int stepnum;
+extern int actuatornum;
+extern mjtNum* state_target;
+extern AlignedMatrix stabilizer_feedback_gain;
+extern const ModelKernel model_kernels[];
+extern const int model_kernel_num;
+
+// hyperparameters
+extern mjtNum Q, QT, R;
+extern AlignedMatrix Qm, QTm;
+
+// model and data
+mjModel* m = NULL;
+mjData* d = NULL;
+char keyfilename[100];
+char modelfilename[200];
+char username[30];
+char keyfilepre[20] = "";
+
+
+// timer
+chrono::system_clock::time_point tm_start;
+mjtNum gettm(void)
+{
+    chrono::duration<double> elapsed = chrono::system_clock::now() - tm_start;
+    return elapsed.count();
+}
+
+
+// deallocate and print message
+int finish(const char* msg = NULL, mjModel* m = NULL, mjData* d = NULL)
+{
+    // deallocate model and data
+    if( d )
+        mj_deleteData(d);
+    if( m )
+        mj_deleteModel(m);
+    mj_deactivate();
+
+    // print message
+    if( msg )
+        printf("%s\n", msg);
+
+    return 0;
+}
+
+// nanoseconds per stepCost call over running and terminal steps, the sum goes to *value
+mjtNum timeCost(int ncall, mjtNum* value)
+{
+	mjtNum sum = 0, start = gettm();
+
+	for (int k = 0; k < ncall; k++) sum += stepCost(m, d, (k & 1) ? stepnum : 0);
+	*value = sum;
+	return (gettm() - start) / ncall * 1e9;
+}
+
+// nanoseconds per terminalCtrl call, the sum of the controls goes to *value
+mjtNum timeFeedback(int ncall, mjtNum* value)
+{
+	mjtNum sum = 0, start = gettm();
+
+	for (int k = 0; k < ncall; k++) {
+		terminalCtrl(m, d, stepnum + 1);
+		sum += d->ctrl[0];
+	}
+	*value = sum;
+	return (gettm() - start) / ncall * 1e9;
+}
+
+
+// main function
+int main(int argc, const char** argv)
+{
+    // print help if arguments are missing
+    if( argc>3 )
+        return finish("\n Usage: kernelbench [modeldir [ncall]]\n");
+
+    // activate MuJoCo Pro license (this must be *your* activation key)
+	DWORD usernamesize = 30;
+	GetUserName(username, &usernamesize);
+	if (username[0] == 'R') {
+		strcpy(keyfilename, keyfilepre);
+		strcat(keyfilename, "mjkeybig.txt");
+		mj_activate(keyfilename);
+	}
+	else if (username[0] == 'r') {
+		strcpy(keyfilename, keyfilepre);
+		strcat(keyfilename, "mjkeyda.txt");
+		mj_activate(keyfilename);
+	}
+	else {
+		strcpy(keyfilename, keyfilepre);
+		strcat(keyfilename, "mjkeysmall.txt");
+		mj_activate(keyfilename);
+	}
+
+	// read model directory and call number
+	const char* modeldir = argc > 1 ? argv[1] : "model";
+	int ncall = 1000000;
+	if (argc > 2 && (sscanf(argv[2], "%d", &ncall) != 1 || ncall <= 0))
+		return finish("Invalid ncall argument");
+
+	printf("\n %-10s %-9s %12s %12s %9s %12s\n", "Model", "Kernel", "generic ns", "fixed ns", "speedup", "difference");
+	tm_start = chrono::system_clock::now();
+	for (int k = 0; k < model_kernel_num; k++) {
+		const ModelKernel* e = model_kernels + k;
+		char error[500] = "";
+
+		// every registered model from its config and model file
+		snprintf(modelfilename, sizeof(modelfilename), "%s/%s", modeldir, e->name);
+		if (modelSelection(modelfilename) != 1) {
+			printf(" %-10s no config\n", e->name);
+			continue;
+		}
+		strcat(modelfilename, ".xml");
+		m = mj_loadXML(modelfilename, 0, error, 500);
+		if (!m || modelDimension(m) != 1 || !(d = mj_makeData(m))) {
+			printf(" %-10s could not load %s %s\n", e->name, modelfilename, error);
+			if (m) mj_deleteModel(m);
+			m = NULL;
+			continue;
+		}
+
+		if (!kernelSelect(m, 1)) {
+			printf(" %-10s no kernel for the dimensions of %s\n", e->name, modelfilename);
+			mj_deleteData(d);
+			mj_deleteModel(m);
+			d = NULL;
+			m = NULL;
+			continue;
+		}
+
+		// unit weights, a state off the target and a nonzero control
+		Q = QT = R = 1;
+		for (int i = 0; i < Qm.rows; i++) Qm[i][i] = QTm[i][i] = 1;
+		for (int i = 0; i < m->nq; i++) d->qpos[i] = 0.1 * (i + 1);
+		for (int i = 0; i < m->nv; i++) d->qvel[i] = -0.2 * (i + 1);
+		for (int i = 0; i < m->nu; i++) d->ctrl[i] = 0.3;
+		if (!stabilizer_feedback_gain.data[0]) stabilizer_feedback_gain.data[0] = 1;
+
+		// generic and fixed path of each kernel on the same data
+		mjtNum value_generic, value_fixed;
+		if (e->cost) {
+			kernelSelect(m, 0);
+			mjtNum generic = timeCost(ncall, &value_generic);
+			kernelSelect(m, 1);
+			mjtNum fixed = timeCost(ncall, &value_fixed);
+			printf(" %-10s %-9s %12.2f %12.2f %8.2fx %12.3e\n", e->name, "stepCost", generic, fixed, generic / fixed, mju_abs(value_generic - value_fixed));
+		}
+		kernelSelect(m, 0);
+		mjtNum generic = timeFeedback(ncall, &value_generic);
+		kernelSelect(m, 1);
+		mjtNum fixed = timeFeedback(ncall, &value_fixed);
+		printf(" %-10s %-9s %12.2f %12.2f %8.2fx %12.3e\n", e->name, "feedback", generic, fixed, generic / fixed, mju_abs(value_generic - value_fixed));
+
+		mj_deleteData(d);
+		mj_deleteModel(m);
+		d = NULL;
+		m = NULL;
+	}
+
+	return finish();
+}
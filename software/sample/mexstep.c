@@ -20,6 +20,7 @@
 // model
 mjModel* m = 0;
 mjData* d = 0;
+int staged = 0;     // position and velocity stages of the current state are computed, the next step starts with mj_step2
 char error[1000];
 char username[30];
 
@@ -96,6 +97,7 @@ void mexFunction(int nout, mxArray* pout[], int nin, const mxArray* pin[])
         // make data and update
         d = mj_makeData(m);
         mj_forward(m, d);
+        staged = 1;
         return;
     }
     //---------------------------- terminate
@@ -128,31 +130,44 @@ void mexFunction(int nout, mxArray* pout[], int nin, const mxArray* pin[])
             nc=mxGetScalar(pin[3]);nr=1;
             // copy data (assuming mjtNum is double)
             memcpy(fielddata, mxGetPr(pin[2]), nr*nc*sizeof(double));
+
+            // the stages do not depend on the controls, any other field has to be recomputed by the next step
+            if( strcmp(fieldname, "ctrl") )
+                staged = 0;
         }
     }
    //---------------------------- step [number]
+    // sites and sensors of the new state are computed, no forward is needed after a step
     else if( !strcmp(command, "step") )
     {
-        // no number
-        if( nin<2 )
-            mj_step(m, d);
+        // no number: one step
+        int number = 1;
 
         // number of steps specified
-        else
+        if( nin>=2 )
         {
             // get number of steps
-            int number = mju_round(mxGetScalar(pin[1]));
+            number = mju_round(mxGetScalar(pin[1]));
             if( number<0 )
                 char error[1000] = "invalid nunber";
+        }
 
-            // run for specified number of steps
-            for( int i=0; i<number; i++ )
+        // run for specified number of steps, the Euler integrator reuses the computed stages in the first one
+        for( int i=0; i<number; i++ )
+        {
+            if( staged && m->opt.integrator==mjINT_EULER )
+                mj_step2(m, d);
+            else
                 mj_step(m, d);
+            staged = 0;
         }
+        mj_step1(m, d);
+        staged = 1;
     }
    //---------------------------- forward
     else if( !strcmp(command, "forward") )
     {
         mj_forward(m, d);
+        staged = 1;
     }
 }
\ No newline at end of file
@@ -9,6 +9,10 @@
 
 #include <windows.h>
 #include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <algorithm>
 #include "funclib.h"
 
 //-------------------------------- user macros --------------------------------------
@@ -16,9 +20,14 @@
 
 //-------------------------------- global variables -------------------------------------
 // constants
-extern const int kMaxStep = 3000;   // max step number for one rollout
 extern const int kMaxState = 160;	// max (state dimension, actuator number)
-const int kMaxThread = 1;
+const int kMaxThread = 64;          // max rollout worker number
+const int kMaxWindow = 256;         // max perturbation window number
+const int kMaxInit = 256;           // max initial state number
+const int kMaxConfig = 16;          // max extra cost configuration number
+const int kMaxSweep = 1024;         // max hyperparameter sweep configuration number
+const int kReduceChunk = 4096;      // gradient elements per reduction job
+const int kMaxReuse = 16;           // max number of previous batches kept for reuse
 const mjtNum kMaxUpdate = 0.1;
 
 // extern model specific parameters
@@ -32,34 +41,164 @@ extern mjtNum control_timestep;
 extern mjtNum simulation_timestep;
 extern mjtNum ctrl_upperlimit;
 extern mjtNum ctrl_upperlimit;
-extern mjtNum state_nominal[kMaxStep][kMaxState];
-extern mjtNum state_target[kMaxState];
+extern AlignedMatrix state_nominal;
+extern mjtNum* state_target;
 extern char testmode[30];
 
 // user data and other training settings
-mjtNum ctrl_current[kMaxThread][kMaxStep * kMaxState] = { 0 };
-mjtNum ctrl_init[kMaxStep * kMaxState] = { 0 };
-mjtNum gradient[kMaxThread][kMaxStep*kMaxState] = { 0 };
-mjtNum delta_u[kMaxThread][kMaxStep*kMaxState] = { 0 };
+// control sequences, stepnum x actuatornum in aligned buffers allocated once the model is loaded
+mjtNum *ctrl_current = NULL;
+mjtNum *ctrl_init = NULL;
+mjtNum *gradient = NULL;            // gradient in the perturbation space (ptbdim)
+mjtNum *ctrl_step = NULL;           // update of the controls at every step
+mjtNum *ctrl_best = NULL;           // control with the lowest nominal cost so far
+mjtNum gradient_norm = 0;                        // norm of the last gradient estimate
+mjtNum *delta_u = NULL;             // perturbations of one batch, one row of ptbdim per perturbation
+mjtNum *rollout_cost = NULL;        // episodic cost of every perturbed rollout in the batch
+mjtNum *rollout_weight = NULL;      // gradient weight of every perturbation in the batch
+int ptbnum = 0;                     // number of perturbations per batch
+int antithetic = 0;                 // 1: evaluate every perturbation as a (+delta_u, -delta_u) pair
+int qmc = 0;                        // 1: draw the perturbations of a batch as scrambled Sobol points
+int *qmc_order = NULL;              // Sobol point order of every chunk in the batch
+int basis = 0;                      // control parameterization, 0: every step, 1: cubic B-spline, 2: DCT
+int basisnum = 0;                   // basis function number per actuator
+int ptbdim = 0;                     // dimension of a perturbation, basisnum*actuatornum with a basis
+mjtNum *basis_matrix = NULL;        // stepnum x basisnum basis sampled at every step
+mjtNum *ptb_step[kMaxThread];       // per-thread perturbation expanded to every step
+mjtNum batch_nominal_cost = 0;      // episodic cost of the nominal rollout in the batch
+int batch_iteration = 0;            // iteration index of the batch, selects the random streams
+int batch_offset = 0;               // added to the iteration index of every batch, every MPC replan has its own streams
+uint64_t seed = 0;                  // the perturbations only depend on (seed, iteration, rollout)
 FILE *filestream2, *filestream3;
-static int iteration_index[kMaxThread] = { 0 };
 char data_buff[30];
 char keyfilename[100];
 char datafilename[100];
 char modelfilename[100];
 char username[30];
 char modelname[30];
+char warmfilename[100] = "";        // result file to resample into the initial controls instead of init.txt
+int warm_spline = 0;                // warm start interpolation, 0: linear, 1: cubic spline
 char keyfilepre[20] = "";
 
 /* hyperparameters */
 extern mjtNum Q, QT, R;
-extern mjtNum Qm[kMaxState][kMaxState], QTm[kMaxState][kMaxState];
-mjtNum perturb_coefficient_train[kMaxThread], update_coefficient[kMaxThread];
+extern AlignedMatrix Qm, QTm;
+mjtNum perturb_coefficient_train, update_coefficient;
 mjtNum perturb_coefficient_train_init, update_coefficient_init;
 
+/* update rule and learning rate schedule */
+int update_rule = 0;                // 0: SGD, 1: Nesterov momentum, 2: RMSProp, 3: Adam
+int lr_schedule = 0;                // 0: constant, 1: step, 2: exponential, 3: cosine
+mjtNum momentum = 0.9;              // Nesterov momentum
+mjtNum beta1 = 0.9, beta2 = 0.999;  // Adam first and second moment decay, beta2 is also the RMSProp decay
+mjtNum lr_decay = 0.1;              // step: factor every lr_step iterations, exponential: factor per iteration
+int lr_step = 100;
+mjtNum *update_m = NULL;            // per-element first moment / velocity
+mjtNum *update_v = NULL;            // per-element second moment
+
+/* line search over step sizes */
+int line_search = 0;                // number of step sizes tried every iteration, 0: fixed step
+mjtNum line_lr = 0;                 // learning rate adapted by the line search
+mjtNum *line_delta = NULL;          // control change of every step size
+mjtNum *line_cost = NULL;           // episodic cost of every step size
+
+/* search engine state */
+int engine = 0;                     // 0: finite-difference gradient, 1: separable CMA-ES, 2: cross-entropy method
+mjtNum search_sigma = 0;            // CMA-ES global step size
+mjtNum *search_std = NULL;          // per-element standard deviation: CMA-ES sqrt(diag C), CEM sampling std
+mjtNum *cma_c = NULL;               // CMA-ES diagonal covariance
+mjtNum *cma_ps = NULL;              // CMA-ES step size evolution path
+mjtNum *cma_pc = NULL;              // CMA-ES covariance evolution path
+mjtNum *search_mean = NULL;         // weighted mean of the selected perturbations
+mjtNum *search_var = NULL;          // weighted mean of the squared selected perturbations
+int *member_order = NULL;           // population members sorted by cost
+mjtNum cem_elite = 0.2;             // CEM elite fraction of the population
+mjtNum cem_smooth = 0.7;            // CEM weight of the new standard deviation
+
+/* checkpoint */
+int checkpoint_every = 0;           // iterations between checkpoints, 0: no checkpoint
+bool resume = false;                // continue from checkpoint<id>.bin
+int resume_train = 0;               // task and iteration the checkpoint continues with
+int resume_iteration = 0;
+RowVectorXd nominal_cost;           // nominal episodic cost of every iteration of the current task
+
+/* stopping criteria */
+int stop_window = 0;                // stop if the best cost improved by less than stop_rel over stop_window iterations
+mjtNum stop_rel = 0;
+mjtNum stop_grad = 0;               // stop if the gradient norm is below stop_grad, gradient engine only
+mjtNum deadline = 0;                // stop before the training time would exceed deadline seconds, 0: no deadline
+mjtNum best_cost = 0;               // lowest nominal cost of the task, reached by ctrl_best
+double rollout_total = 0;           // rollouts simulated by train, windowed rollouts count by their length
+
+/* windowed perturbation */
+int windownum = 0;                  // number of time windows, every rollout perturbs one window, 0: whole horizon
+int window_len = 0;                 // steps per window
+int window_tail = -1;               // steps simulated after the window before the nominal cost is used, -1: to the end
+mjData* window_data[kMaxWindow];    // nominal state at the start of every window
+mjtNum *nominal_stage = NULL;       // cumulative nominal cost before every step, the last entry is the episodic cost
+
+/* multi-fidelity schedule */
+int fidelity_levels = 1;            // physics levels, level l takes fidelity_factor^l times fewer mj_step per control step
+int fidelity_factor = 2;
+int fidelity_iter = 0;              // max iterations of a coarse level, 0: niteration / fidelity_levels
+int fidelity_check = 10;            // iterations between cost agreement checks on a coarse level
+mjtNum fidelity_tol = 0.05;         // relative cost difference to the next finer level that ends a coarse level
+int fidelity_level = 0;             // current level, 0 is the model timestep
+int level_start = 0;                // first iteration of the current level
+int integration_fine = 1;           // integration_per_step of level 0
+
+/* batch of initial states */
+int init_num = 1;                   // number of initial states every cost is averaged over
+mjtNum init_spread = 0;             // standard deviation of the sampled initial states around state_nominal[0]
+char initfilename[100] = "";        // file with one initial state per row, replaces the sampled states
+extern int statedim;                // length of an initial state, 2*dof+quatnum
+mjtNum *init_state = NULL;          // init_num x statedim initial states
+mjtNum *state_cost = NULL;          // cost of every (rollout, initial state) pair of a batch, init_num per rollout
+
+/* extra cost configurations scored on the nominal rollouts */
+int confignum = 0;                  // number of extra cost configurations
+CostConfig cost_config[kMaxConfig];
+mjtNum config_target[kMaxConfig][kMaxState];
+mjtNum *config_matrix = NULL;       // Qm and QTm of every configuration
+mjtNum config_cost[kMaxConfig];     // nominal episodic cost under every configuration
+mjtNum *state_config_cost = NULL;   // nominal episodic cost under every configuration from every initial state
+
+/* hyperparameter sweep */
+char sweepfilename[100] = "";       // sweep specification, empty: a single training
+int sweepnum = 0;                   // number of configurations
+int sweep_random = 0;               // number of random search samples, 0: grid
+mjtNum sweep_value[kMaxSweep][5];   // Q, QT, R, ptb_coef, step_coef of every configuration
+int iteration_done = 0;             // iterations run by the last task
+
+/* receding-horizon control */
+int mpc_horizon = 0;                // steps planned at every replan, 0: open-loop training over the whole horizon
+mjtNum mpc_budget = 0;              // time budget of a replan in ms, 0: no budget
+mjData* rollout_start = NULL;       // state every rollout starts from instead of the initial state, the MPC plant
+mjtNum iteration_estimate = 0;      // expected time of one iteration, no iteration is started if it exceeds the deadline
+
+/* importance-weighted reuse of previous batches */
+int reuse = 0;                      // previous batches kept for reuse, 0: every batch is simulated fresh
+int reuse_fresh = 0;                // fresh perturbations of a batch that reuses the history, 0: ptbnum / 2
+mjtNum reuse_ess = 0.9;             // min effective sample size of a reusing batch as a fraction of ptbnum
+int batch_fresh = 0;                // perturbations simulated in the current batch
+bool reuse_on = false;              // the current batch reuses the history
+int reuse_used = 0;                 // filled history slots
+int reuse_next = 0;                 // slot the next batch is stored in
+int reuse_count[kMaxReuse];         // perturbations stored in every slot
+int reuse_level[kMaxReuse];         // fidelity level of every slot
+mjtNum reuse_sigma[kMaxReuse];      // perturbation standard deviation of every slot
+mjtNum *reuse_ctrl = NULL;          // control the perturbations of every slot were drawn around, ptbdim per slot
+mjtNum *reuse_ptb = NULL;           // perturbations of every slot, ptbnum x ptbdim per slot
+mjtNum *reuse_cost = NULL;          // perturbed episodic costs of every slot, ptbnum per slot
+mjtNum *reuse_weight = NULL;        // importance weight, then gradient weight, of every stored perturbation
+mjtNum reuse_fresh_weight = 1;      // importance weight of a fresh perturbation on the same scale
+int reuse_batches = 0;              // batches that reused the history
+double reuse_saved = 0;             // perturbed rollouts saved by the reuse
+
 // model and per-thread data
 mjModel* m = NULL;
 mjData* d[kMaxThread];
+int nthread = 1;
 
 // per-thread statistics
 int contacts[kMaxThread];
@@ -67,6 +206,16 @@ int constraints[kMaxThread];
 double simtime[kMaxThread];
 double printfraction = 0.2;
 
+// rollout pool: workers sleep until a batch is posted, then pull job indices until the batch is drained
+std::mutex pool_mtx;
+std::condition_variable pool_start, pool_done;
+std::atomic<int> pool_next(0);
+void (*pool_job)(int id, int index) = NULL;
+int pool_njob = 0;
+int pool_batch = 0;
+int pool_busy = 0;
+bool pool_exit = false;
+
 
 // timer
 chrono::system_clock::time_point tm_start;
@@ -92,111 +241,1226 @@ int finish(const char* msg = NULL, mjModel* m = NULL)
     return 0;
 }
 
+// worker thread: run jobs of every posted batch on its own mjData
+void worker(int id)
+{
+	int batch = 0;
+
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(pool_mtx);
+			pool_start.wait(lock, [&] { return pool_exit || pool_batch != batch; });
+			if (pool_exit) return;
+			batch = pool_batch;
+		}
+		for (int index = pool_next++; index < pool_njob; index = pool_next++)
+			pool_job(id, index);
+		{
+			std::lock_guard<std::mutex> lock(pool_mtx);
+			if (--pool_busy == 0) pool_done.notify_one();
+		}
+	}
+}
+
+// post njob jobs to the workers and wait until all of them are finished
+void runBatch(void (*job)(int id, int index), int njob)
+{
+	std::unique_lock<std::mutex> lock(pool_mtx);
+	pool_job = job;
+	pool_njob = njob;
+	pool_next = 0;
+	pool_busy = nthread;
+	pool_batch++;
+	pool_start.notify_all();
+	pool_done.wait(lock, [] { return pool_busy == 0; });
+}
+
+// add the step cost under every extra cost configuration
+void configCost(mjtNum* res, mjData* d, int step_index)
+{
+	for (int k = 0; k < confignum; k++) res[k] += stepCost(m, d, step_index, cost_config + k);
+}
+
+// simulate ctrl_current + sign*ptb from an initial state and return the episodic cost, ptb = NULL for the nominal rollout
+// configcost: if not NULL, the episodic cost under every extra cost configuration of the same simulation
+mjtNum rollout(mjData* d, const mjtNum* ptb, mjtNum sign = 1, int state = 0, mjtNum* configcost = NULL)
+{
+	mjtNum cost = 0;
+
+	if (configcost) mju_zero(configcost, confignum);
+	if (rollout_start) mj_copyData(d, m, rollout_start);
+	else modelInit(m, d, init_state + (size_t)state * statedim);
+	for (int step_index = 0; step_index < stepnum; step_index++) {
+		for (int i = 0; i < actuatornum; i++) d->ctrl[i] = ctrl_current[step_index * actuatornum + i] + (ptb ? sign * ptb[step_index * actuatornum + i] : 0);
+		cost += stepCost(m, d, step_index);
+		if (configcost) configCost(configcost, d, step_index);
+		controlStep(m, d);
+	}
+	if (configcost) configCost(configcost, d, stepnum);
+	return cost + stepCost(m, d, stepnum);
+}
+
+// nominal rollout that records the state at every window start and the cumulative cost
+mjtNum rolloutRecord(mjData* d)
+{
+	mju_zero(config_cost, confignum);
+	modelInit(m, d, init_state);
+	nominal_stage[0] = 0;
+	for (int step_index = 0; step_index < stepnum; step_index++) {
+		if (step_index % window_len == 0) mj_copyData(window_data[step_index / window_len], m, d);
+		for (int i = 0; i < actuatornum; i++) d->ctrl[i] = ctrl_current[step_index * actuatornum + i];
+		nominal_stage[step_index + 1] = nominal_stage[step_index] + stepCost(m, d, step_index);
+		configCost(config_cost, d, step_index);
+		controlStep(m, d);
+	}
+	configCost(config_cost, d, stepnum);
+	nominal_stage[stepnum + 1] = nominal_stage[stepnum] + stepCost(m, d, stepnum);
+	return nominal_stage[stepnum + 1];
+}
+
+// first and last + 1 step simulated by a rollout perturbing window
+void windowRange(int window, int* begin, int* end)
+{
+	*begin = window * window_len;
+	*end = mjMIN(stepnum, (window + 1) * window_len);
+	if (window_tail < 0) *end = stepnum;
+	else *end = mjMIN(stepnum, *end + window_tail);
+}
+
+// perturb one window starting from its nominal snapshot, the cost before the window and after the tail is the nominal one
+mjtNum rolloutWindow(mjData* d, int window, const mjtNum* ptb, mjtNum sign = 1)
+{
+	int begin, end;
+	windowRange(window, &begin, &end);
+	mjtNum cost = nominal_stage[begin];
+
+	mj_copyData(d, m, window_data[window]);
+	for (int step_index = begin; step_index < end; step_index++) {
+		for (int i = 0; i < actuatornum; i++) d->ctrl[i] = ctrl_current[step_index * actuatornum + i] + sign * ptb[step_index * actuatornum + i];
+		cost += stepCost(m, d, step_index);
+		controlStep(m, d);
+	}
+	if (end == stepnum) return cost + stepCost(m, d, stepnum);
+	return cost + nominal_stage[stepnum + 1] - nominal_stage[end];
+}
+
+// number of perturbations of a window, perturbation r perturbs window r % windownum
+int windowCount(int window)
+{
+	return ptbnum / windownum + (window < ptbnum % windownum ? 1 : 0);
+}
+
+// set the physics timestep of a fidelity level, the control timestep is kept
+void setFidelity(int level)
+{
+	int factor = 1;
+	for (int l = 0; l < level; l++) factor *= fidelity_factor;
+	integration_per_step = mjMAX(1, integration_fine / factor);
+	m->opt.timestep = level ? simulation_timestep * integration_fine / integration_per_step : simulation_timestep;
+	fidelity_level = level;
+}
+
+// cost of a rollout at the current level in rollouts at level 0
+double stepScale(void)
+{
+	return (double)integration_per_step / integration_fine;
+}
+
+// expand basis coefficients (basisnum x actuatornum) to controls at every step (stepnum x actuatornum)
+void basisExpand(mjtNum* res, const mjtNum* coef)
+{
+	typedef Matrix<mjtNum, Dynamic, Dynamic, RowMajor> RowMatrix;
+
+	Map<RowMatrix>(res, stepnum, actuatornum).noalias() =
+		Map<const RowMatrix>(basis_matrix, stepnum, basisnum) * Map<const RowMatrix>(coef, basisnum, actuatornum);
+}
+
+// learning rate of an iteration
+mjtNum learningRate(int iteration_index, int niteration)
+{
+	switch (lr_schedule) {
+	case 1: return update_coefficient_init * pow(lr_decay, iteration_index / mjMAX(1, lr_step));
+	case 2: return update_coefficient_init * pow(lr_decay, iteration_index);
+	case 3: return update_coefficient_init * 0.5 * (1 + cos(PI * iteration_index / niteration));
+	default: return update_coefficient_init;
+	}
+}
+
+// step to subtract from the parameters given the gradient, step may alias grad, iteration_index counts from 0 for the bias correction
+void updateStep(mjtNum* step, const mjtNum* grad, int n, int iteration_index)
+{
+	const mjtNum kEps = 1e-8;
+
+	switch (update_rule) {
+	case 1:
+		for (int i = 0; i < n; i++) {
+			update_m[i] = momentum * update_m[i] + grad[i];
+			step[i] = update_coefficient * (grad[i] + momentum * update_m[i]);
+		}
+		break;
+	case 2:
+		for (int i = 0; i < n; i++) {
+			update_v[i] = beta2 * update_v[i] + (1 - beta2) * grad[i] * grad[i];
+			step[i] = update_coefficient * grad[i] / (sqrt(update_v[i]) + kEps);
+		}
+		break;
+	case 3: {
+		mjtNum correction1 = 1 - pow(beta1, iteration_index + 1);
+		mjtNum correction2 = 1 - pow(beta2, iteration_index + 1);
+		for (int i = 0; i < n; i++) {
+			update_m[i] = beta1 * update_m[i] + (1 - beta1) * grad[i];
+			update_v[i] = beta2 * update_v[i] + (1 - beta2) * grad[i] * grad[i];
+			step[i] = update_coefficient * (update_m[i] / correction1) / (sqrt(update_v[i] / correction2) + kEps);
+		}
+		break;
+	}
+	default:
+		mju_scl(step, grad, update_coefficient, n);
+	}
+}
+
+// step size factor of line search candidate k, powers of 2 centered on the current learning rate
+mjtNum lineFactor(int k)
+{
+	return pow(2.0, k - 0.5 * (line_search - 1));
+}
+
+// control change of line search candidate index after the clipped step
+void lineDelta(int index)
+{
+	int ndim = actuatornum * stepnum;
+	mjtNum *delta = line_delta + (size_t)index * ndim;
+	mjtNum scale = lineFactor(index);
+
+	mju_copy(delta, ctrl_current, ndim);
+	ctrlStep(delta, ctrl_step, scale, kMaxUpdate, ndim);
+	mju_subFrom(delta, ctrl_current, ndim);
+}
+
+// line search job: candidate index simulated as a nominal rollout
+void lineJob(int id, int index)
+{
+	lineDelta(index);
+	line_cost[index] = rollout(d[id], line_delta + (size_t)index * actuatornum * stepnum);
+}
+
+// line search job with initial states: candidate index / init_num from initial state index % init_num
+void lineStateJob(int id, int index)
+{
+	int state = index % init_num;
+	state_cost[index] = rollout(d[id], line_delta + (size_t)(index / init_num) * actuatornum * stepnum, 1, state);
+}
+
+// sign and row in delta_u of population member j, an antithetic pair is two members
+mjtNum memberSign(int j) { return (antithetic && (j % 2)) ? -1 : 1; }
+int memberRow(int j) { return antithetic ? j / 2 : j; }
+
+// sort the population members by cost
+void memberSort(void)
+{
+	for (int j = 0; j < rolloutnum_train; j++) member_order[j] = j;
+	std::stable_sort(member_order, member_order + rolloutnum_train, [](int a, int b) { return rollout_cost[a] < rollout_cost[b]; });
+}
+
+// weighted mean and mean square of the perturbations of the best nselect members
+void memberMoments(const mjtNum* weight, int nselect)
+{
+	mju_zero(search_mean, ptbdim);
+	mju_zero(search_var, ptbdim);
+	for (int i = 0; i < nselect; i++) {
+		int j = member_order[i];
+		mjtNum w = weight ? weight[i] : 1.0 / nselect;
+		mjtNum *ptb = delta_u + (size_t)memberRow(j) * ptbdim;
+		mju_addToScl(search_mean, ptb, memberSign(j) * w, ptbdim);
+		for (int k = 0; k < ptbdim; k++) search_var[k] += w * ptb[k] * ptb[k];
+	}
+}
+
+// finite-difference gradient engine
+void gradientReset(void)
+{
+	mju_zero(update_m, ptbdim);
+	mju_zero(update_v, ptbdim);
+}
+
+void gradientShape(mjtNum* ptb)
+{
+	mju_scl(ptb, ptb, perturb_coefficient_train, ptbdim);
+}
+
+// reduce one chunk of gradient elements as a GEMV of the transposed perturbation block with the weights,
+// the chunks are fixed by ptbdim only, so the gradient is bitwise identical at any thread count
+void reduceJob(int /*id*/, int index)
+{
+	typedef Matrix<mjtNum, Dynamic, Dynamic, RowMajor> RowMatrix;
+	int start = index * kReduceChunk, n = mjMIN(kReduceChunk, ptbdim - start);
+	Map<const RowMatrix, 0, OuterStride<>> ptb(delta_u + start, batch_fresh, n, OuterStride<>(ptbdim));
+	Map<const Matrix<mjtNum, Dynamic, 1>> weight(rollout_weight, batch_fresh);
+	Map<Matrix<mjtNum, Dynamic, 1>> grad(gradient + start, n);
+
+	grad.noalias() = ptb.transpose() * weight;
+
+	// stored perturbations of a reusing batch, measured from the current control: ptb + ctrl_j - ctrl_current
+	if (reuse_on)
+		for (int j = 0; j < reuse_used; j++) {
+			Map<const RowMatrix, 0, OuterStride<>> old(reuse_ptb + (size_t)j * ptbnum * ptbdim + start, reuse_count[j], n, OuterStride<>(ptbdim));
+			Map<const Matrix<mjtNum, Dynamic, 1>> oldweight(reuse_weight + (size_t)j * ptbnum, reuse_count[j]);
+			Map<const Matrix<mjtNum, Dynamic, 1>> ctrl(reuse_ctrl + (size_t)j * ptbdim + start, n), current(ctrl_current + start, n);
+			grad.noalias() += old.transpose() * oldweight;
+			grad += oldweight.sum() * (ctrl - current);
+		}
+}
+
+// log density ratio of stored perturbation i of slot j under the current control and the control it was drawn around
+mjtNum reuseLogWeight(int j, int i)
+{
+	const mjtNum *ptb = reuse_ptb + ((size_t)j * ptbnum + i) * ptbdim;
+	const mjtNum *ctrl = reuse_ctrl + (size_t)j * ptbdim;
+	mjtNum sigma = perturb_coefficient_train, sigma_old = reuse_sigma[j];
+	mjtNum dist = 0, norm = 0;
+
+	for (int k = 0; k < ptbdim; k++) {
+		mjtNum x = ptb[k] + ctrl[k] - ctrl_current[k];
+		dist += x * x;
+		norm += ptb[k] * ptb[k];
+	}
+	return norm / (2 * sigma_old * sigma_old) - dist / (2 * sigma * sigma) + ptbdim * log(sigma_old / sigma);
+}
+
+// importance weights of the stored perturbations, scaled so that the largest weight of the batch is 1
+// returns the effective sample size of the history together with nfresh fresh perturbations
+// costs of another fidelity level are not comparable, their slots get zero weight
+mjtNum reuseWeights(int nfresh)
+{
+	mjtNum maxlog = 0, sum, sum2;
+
+	for (int j = 0; j < reuse_used; j++)
+		for (int i = 0; i < reuse_count[j]; i++) {
+			mjtNum *w = reuse_weight + (size_t)j * ptbnum + i;
+			*w = reuse_level[j] == fidelity_level ? reuseLogWeight(j, i) : -mjMAXVAL;
+			maxlog = mjMAX(maxlog, *w);
+		}
+	reuse_fresh_weight = exp(-maxlog);
+	sum = nfresh * reuse_fresh_weight;
+	sum2 = nfresh * reuse_fresh_weight * reuse_fresh_weight;
+	for (int j = 0; j < reuse_used; j++)
+		for (int i = 0; i < reuse_count[j]; i++) {
+			mjtNum *w = reuse_weight + (size_t)j * ptbnum + i;
+			*w = exp(*w - maxlog);
+			sum += *w;
+			sum2 += *w * *w;
+		}
+	return sum * sum / sum2;
+}
+
+// store the fresh perturbations of the batch with the control and perturbation size they were drawn with
+void reuseStore(void)
+{
+	int j = reuse_next;
+
+	mju_copy(reuse_ptb + (size_t)j * ptbnum * ptbdim, delta_u, batch_fresh * ptbdim);
+	mju_copy(reuse_cost + (size_t)j * ptbnum, rollout_cost, batch_fresh);
+	mju_copy(reuse_ctrl + (size_t)j * ptbdim, ctrl_current, ptbdim);
+	reuse_count[j] = batch_fresh;
+	reuse_level[j] = fidelity_level;
+	reuse_sigma[j] = perturb_coefficient_train;
+	reuse_next = (j + 1) % reuse;
+	reuse_used = mjMIN(reuse_used + 1, reuse);
+}
+
+void gradientUpdate(mjtNum* step, int iteration_index, int niteration)
+{
+	static char str1[30];
+
+	// gradient weights: forward difference against the nominal cost, or central difference (J+ - J-) / 2 of the pair
+	mjtNum weight_total = ptbnum;
+	for (int ptb_index = 0; ptb_index < batch_fresh; ptb_index++)
+	{
+		if (antithetic) rollout_weight[ptb_index] = 0.5 * (rollout_cost[2 * ptb_index] - rollout_cost[2 * ptb_index + 1]);
+		else rollout_weight[ptb_index] = rollout_cost[ptb_index] - batch_nominal_cost;
+	}
+
+	// reusing batch: self-normalized importance weights over the fresh and the stored perturbations
+	if (reuse_on) {
+		weight_total = batch_fresh * reuse_fresh_weight;
+		mju_scl(rollout_weight, rollout_weight, reuse_fresh_weight, batch_fresh);
+		for (int j = 0; j < reuse_used; j++)
+			for (int i = 0; i < reuse_count[j]; i++) {
+				size_t k = (size_t)j * ptbnum + i;
+				weight_total += reuse_weight[k];
+				reuse_weight[k] *= reuse_cost[k] - batch_nominal_cost;
+			}
+	}
+
+	// reduce the weighted perturbations into the gradient, in basis coefficients if a basis is used
+	runBatch(reduceJob, (ptbdim + kReduceChunk - 1) / kReduceChunk);
+
+	// running average of one element for convergence checking
+	mjtNum gradient_check = 0;
+	for (int ptb_index = 0; ptb_index < batch_fresh; ptb_index++)
+	{
+		gradient_check += rollout_weight[ptb_index] * delta_u[(size_t)ptb_index * ptbdim + 2];
+		sprintf(str1, "%3.3f", gradient_check / ((ptb_index + 1.0)*perturb_coefficient_train*perturb_coefficient_train));
+		fwrite(str1, 5, 1, filestream2);
+		fputs(" ", filestream2);
+	}
+	fputs("\n", filestream2);
+	mju_scl(gradient, gradient, 1 / (weight_total*perturb_coefficient_train*perturb_coefficient_train), ptbdim);
+	if (windownum)
+		for (int k = 0; k < ptbdim; k++)
+			gradient[k] *= (mjtNum)ptbnum / windowCount(k / actuatornum / window_len);
+	gradient_norm = mju_norm(gradient, ptbdim);
+	if (reuse) reuseStore();
+
+	// step of the update rule at the scheduled or line searched learning rate
+	update_coefficient = line_search ? line_lr : learningRate(iteration_index, niteration);
+	updateStep(step, gradient, ptbdim, iteration_index);
+}
+
+// separable CMA-ES engine (Ros and Hansen 2008), the mean is the current control
+void cmaReset(void)
+{
+	search_sigma = perturb_coefficient_train_init;
+	for (int k = 0; k < ptbdim; k++) search_std[k] = cma_c[k] = 1;
+	mju_zero(cma_ps, ptbdim);
+	mju_zero(cma_pc, ptbdim);
+}
+
+void cmaShape(mjtNum* ptb)
+{
+	for (int k = 0; k < ptbdim; k++) ptb[k] *= search_sigma * search_std[k];
+}
+
+void cmaUpdate(mjtNum* step, int iteration_index, int /*niteration*/)
+{
+	int n = ptbdim, mu = rolloutnum_train / 2;
+	mjtNum weight_sum = 0, mueff = 0;
+
+	// log-linear recombination weights of the best half
+	for (int i = 0; i < mu; i++) {
+		rollout_weight[i] = log(mu + 0.5) - log(i + 1.0);
+		weight_sum += rollout_weight[i];
+	}
+	for (int i = 0; i < mu; i++) {
+		rollout_weight[i] /= weight_sum;
+		mueff += rollout_weight[i] * rollout_weight[i];
+	}
+	mueff = 1 / mueff;
+
+	// learning rates, c1 and cmu scaled by (n + 2) / 3 for the diagonal model
+	mjtNum cs = (mueff + 2) / (n + mueff + 5);
+	mjtNum ds = 1 + 2 * mjMAX(0, sqrt((mueff - 1) / (n + 1)) - 1) + cs;
+	mjtNum cc = (4 + mueff / n) / (n + 4 + 2 * mueff / n);
+	mjtNum c1 = mjMIN(1, (n + 2) / 3.0 * 2 / ((n + 1.3) * (n + 1.3) + mueff));
+	mjtNum cmu = mjMIN(1 - c1, (n + 2) / 3.0 * 2 * (mueff - 2 + 1 / mueff) / ((n + 2) * (n + 2) + mueff));
+	mjtNum chin = sqrt((mjtNum)n) * (1 - 1.0 / (4 * n) + 1.0 / (21.0 * n * n));
+
+	// mean shift y_w = sum w_i y_i with y_i = ptb_i / sigma, and sum w_i y_i^2 for the rank-mu update
+	memberSort();
+	memberMoments(rollout_weight, mu);
+	mju_scl(search_mean, search_mean, 1 / search_sigma, n);
+	mju_scl(search_var, search_var, 1 / (search_sigma * search_sigma), n);
+
+	// evolution paths, C^(-1/2) y_w = y_w / D for the diagonal model
+	mjtNum ps_norm = 0;
+	for (int k = 0; k < n; k++) {
+		cma_ps[k] = (1 - cs) * cma_ps[k] + sqrt(cs * (2 - cs) * mueff) * search_mean[k] / search_std[k];
+		ps_norm += cma_ps[k] * cma_ps[k];
+	}
+	ps_norm = sqrt(ps_norm);
+	bool hs = ps_norm / sqrt(1 - pow(1 - cs, 2 * (iteration_index + 1))) < (1.4 + 2 / (n + 1.0)) * chin;
+	for (int k = 0; k < n; k++) {
+		cma_pc[k] = (1 - cc) * cma_pc[k] + (hs ? sqrt(cc * (2 - cc) * mueff) : 0) * search_mean[k];
+		cma_c[k] = (1 - c1 - cmu) * cma_c[k] + c1 * (cma_pc[k] * cma_pc[k] + (hs ? 0 : cc * (2 - cc) * cma_c[k])) + cmu * search_var[k];
+	}
+
+	// step to subtract is -sigma y_w, then adapt sigma and D
+	mju_scl(step, search_mean, -search_sigma, n);
+	search_sigma *= exp(cs / ds * (ps_norm / chin - 1));
+	for (int k = 0; k < n; k++) search_std[k] = sqrt(cma_c[k]);
+}
+
+// cross-entropy engine: refit the sampling distribution to the elite perturbations
+void cemReset(void)
+{
+	for (int k = 0; k < ptbdim; k++) search_std[k] = perturb_coefficient_train_init;
+}
+
+void cemShape(mjtNum* ptb)
+{
+	for (int k = 0; k < ptbdim; k++) ptb[k] *= search_std[k];
+}
+
+void cemUpdate(mjtNum* step, int /*iteration_index*/, int /*niteration*/)
+{
+	int nelite = mjMAX(1, (int)(cem_elite * rolloutnum_train));
+	mjtNum std_min = 1e-3 * perturb_coefficient_train_init;
+
+	memberSort();
+	memberMoments(NULL, nelite);
+	mju_scl(step, search_mean, -1, ptbdim);
+	for (int k = 0; k < ptbdim; k++) {
+		mjtNum var = mjMAX(0, search_var[k] - search_mean[k] * search_mean[k]);
+		search_std[k] = mjMAX(std_min, cem_smooth * sqrt(var) + (1 - cem_smooth) * search_std[k]);
+	}
+}
+
+// search engines: reset clears the state at task start, shape scales N(0,1) draws into perturbations
+// (called by the workers, read-only on the state), update turns the costs of a batch into the step subtracted from the parameters
+struct SearchEngine
+{
+	const char* name;
+	void (*reset)(void);
+	void (*shape)(mjtNum* ptb);
+	void (*update)(mjtNum* step, int iteration_index, int niteration);
+};
+const SearchEngine search_engine[3] = {
+	{ "Finite-difference gradient", gradientReset, gradientShape, gradientUpdate },
+	{ "Separable CMA-ES", cmaReset, cmaShape, cmaUpdate },
+	{ "Cross-entropy method", cemReset, cemShape, cemUpdate },
+};
+
+// batch job: index 0 is the nominal rollout, index r > 0 is perturbation r - 1
+// in antithetic mode the job runs the pair +delta_u, -delta_u and stores the costs at 2(r - 1), 2(r - 1) + 1
+// in windowed mode perturbation r - 1 is zero outside its window and the nominal rollout has to finish first
+// draw perturbation r - 1 of the batch into delta_u and shape it by the search engine
+mjtNum* samplePerturbation(int index)
+{
+	RandStream stream;
+	mjtNum *ptb = delta_u + (size_t)(index - 1) * ptbdim;
+
+	if (qmc)
+		sobolGaussFill(seed, batch_iteration, qmc_order, ptbnum, index - 1, ptb, ptbdim);
+	else {
+		randStreamInit(&stream, seed, batch_iteration, index - 1);
+		randGaussFill(&stream, ptb, ptbdim);
+	}
+	search_engine[engine].shape(ptb);
+	return ptb;
+}
+
+void rolloutJob(int id, int index)
+{
+	if (index == 0) {
+		batch_nominal_cost = windownum ? rolloutRecord(d[id]) : rollout(d[id], NULL, 1, 0, config_cost);
+		return;
+	}
+	mjtNum *ptb = samplePerturbation(index);
+	mjtNum *ctrl_ptb = ptb;
+
+	if (windownum) {
+		int window = (index - 1) % windownum;
+		int begin = window * window_len * actuatornum;
+		int end = mjMIN(stepnum, (window + 1) * window_len) * actuatornum;
+		mju_zero(ptb, begin);
+		mju_zero(ptb + end, ptbdim - end);
+		if (antithetic) {
+			rollout_cost[2 * (index - 1)] = rolloutWindow(d[id], window, ptb);
+			rollout_cost[2 * (index - 1) + 1] = rolloutWindow(d[id], window, ptb, -1);
+		}
+		else rollout_cost[index - 1] = rolloutWindow(d[id], window, ptb);
+		return;
+	}
+	if (basis) {
+		ctrl_ptb = ptb_step[id];
+		basisExpand(ctrl_ptb, ptb);
+	}
+	if (antithetic) {
+		rollout_cost[2 * (index - 1)] = rollout(d[id], ctrl_ptb);
+		rollout_cost[2 * (index - 1) + 1] = rollout(d[id], ctrl_ptb, -1);
+	}
+	else rollout_cost[index - 1] = rollout(d[id], ctrl_ptb);
+}
+
+// perturbed rollouts of a windowed batch, after the nominal one
+void windowJob(int id, int index)
+{
+	rolloutJob(id, index + 1);
+}
+
+// perturbations of a batch with initial states, drawn before the rollouts that share them
+void noiseJob(int /*id*/, int index)
+{
+	samplePerturbation(index + 1);
+}
+
+// batch job with initial states: rollout index / init_num of rolloutJob from initial state index % init_num
+// the costs go to state_cost, init_num entries per nominal and perturbed rollout
+void stateJob(int id, int index)
+{
+	int state = index % init_num;
+	int r = index / init_num;
+	mjtNum *ctrl_ptb = NULL;
+
+	if (r == 0) {
+		state_cost[state] = rollout(d[id], NULL, 1, state, state_config_cost + (size_t)state * confignum);
+		return;
+	}
+	ctrl_ptb = delta_u + (size_t)(r - 1) * ptbdim;
+	if (basis) {
+		basisExpand(ptb_step[id], ctrl_ptb);
+		ctrl_ptb = ptb_step[id];
+	}
+	if (antithetic) {
+		state_cost[(2 * r - 1) * init_num + state] = rollout(d[id], ctrl_ptb, 1, state);
+		state_cost[2 * r * init_num + state] = rollout(d[id], ctrl_ptb, -1, state);
+	}
+	else state_cost[r * init_num + state] = rollout(d[id], ctrl_ptb, 1, state);
+}
+
+// mean cost over the initial states of n rollouts, init_num costs per rollout
+void stateMean(mjtNum* res, const mjtNum* cost, int n)
+{
+	for (int k = 0; k < n; k++) {
+		mjtNum sum = 0;
+		for (int state = 0; state < init_num; state++) sum += cost[k * init_num + state];
+		res[k] = sum / init_num;
+	}
+}
+
+// mean nominal cost under every extra cost configuration over the initial states
+void configMean(void)
+{
+	for (int k = 0; k < confignum; k++) {
+		mjtNum sum = 0;
+		for (int state = 0; state < init_num; state++) sum += state_config_cost[state * confignum + k];
+		config_cost[k] = sum / init_num;
+	}
+}
+
+// batch of the nominal and the first batch_fresh perturbed rollouts, costs averaged over the initial states
+void runRollouts(void)
+{
+	if (init_num == 1) {
+		runBatch(rolloutJob, batch_fresh + 1);
+		return;
+	}
+	runBatch(noiseJob, batch_fresh);
+	runBatch(stateJob, (batch_fresh + 1) * init_num);
+	stateMean(&batch_nominal_cost, state_cost, 1);
+	configMean();
+	stateMean(rollout_cost, state_cost + init_num, batch_fresh * (rolloutnum_train / ptbnum));
+}
+
+// nominal rollout of ctrl_current, the cost is averaged over the initial states
+void runNominal(void)
+{
+	if (init_num == 1) runBatch(rolloutJob, 1);
+	else {
+		runBatch(stateJob, init_num);
+		stateMean(&batch_nominal_cost, state_cost, 1);
+		configMean();
+	}
+}
+
+// line search candidates, the costs are averaged over the initial states
+void runLineSearch(void)
+{
+	if (init_num == 1) {
+		runBatch(lineJob, line_search);
+		return;
+	}
+	for (int k = 0; k < line_search; k++) lineDelta(k);
+	runBatch(lineStateJob, line_search * init_num);
+	stateMean(line_cost, state_cost, line_search);
+}
+
+// checkpoint header, the sizes and settings must match to resume
+struct CheckpointHeader
+{
+	char magic[8];
+	int version;
+	int stepnum, actuatornum, ptbdim, rolloutnum_train;
+	int engine, update_rule, basis, basisnum, antithetic, qmc, windownum, window_tail, fidelity_levels, fidelity_factor, init_num;
+	int reuse, reuse_fresh;
+	int train_index, iteration_index, fidelity_level, level_start;
+	uint64_t seed;
+};
+
+// write everything the next iteration depends on to checkpoint<id>.bin, via a temporary file replaced in one step
+bool saveCheckpoint(int id, int train_index, int iteration_index)
+{
+	char filename[30], tempname[30];
+	CheckpointHeader header = { "D2CCKPT", 6, stepnum, actuatornum, ptbdim, rolloutnum_train,
+		engine, update_rule, basis, basisnum, antithetic, qmc, windownum, window_tail, fidelity_levels, fidelity_factor, init_num,
+		reuse, reuse_fresh, train_index, iteration_index, fidelity_level, level_start, seed };
+	mjtNum scalar[5] = { update_coefficient, perturb_coefficient_train, line_lr, search_sigma, best_cost };
+	FILE *filestream;
+	bool ok;
+
+	snprintf(filename, sizeof(filename), "%s%d%s", "checkpoint", id, ".bin");
+	snprintf(tempname, sizeof(tempname), "%s%s", filename, ".tmp");
+	if ((filestream = fopen(tempname, "wb")) == NULL) {
+		printf("Could not open file: %s\n", tempname);
+		return false;
+	}
+	ok = fwrite(&header, sizeof(header), 1, filestream) == 1;
+	ok = ok && fwrite(scalar, sizeof(mjtNum), 5, filestream) == 5;
+	ok = ok && fwrite(ctrl_current, sizeof(mjtNum), actuatornum * stepnum, filestream) == (size_t)(actuatornum * stepnum);
+	ok = ok && fwrite(ctrl_best, sizeof(mjtNum), actuatornum * stepnum, filestream) == (size_t)(actuatornum * stepnum);
+	ok = ok && fwrite(update_m, sizeof(mjtNum), ptbdim, filestream) == (size_t)ptbdim;
+	ok = ok && fwrite(update_v, sizeof(mjtNum), ptbdim, filestream) == (size_t)ptbdim;
+	if (engine) {
+		ok = ok && fwrite(search_std, sizeof(mjtNum), ptbdim, filestream) == (size_t)ptbdim;
+		ok = ok && fwrite(cma_c, sizeof(mjtNum), ptbdim, filestream) == (size_t)ptbdim;
+		ok = ok && fwrite(cma_ps, sizeof(mjtNum), ptbdim, filestream) == (size_t)ptbdim;
+		ok = ok && fwrite(cma_pc, sizeof(mjtNum), ptbdim, filestream) == (size_t)ptbdim;
+	}
+	ok = ok && fwrite(nominal_cost.data(), sizeof(mjtNum), iteration_index, filestream) == (size_t)iteration_index;
+	if (reuse) {
+		int slot[2] = { reuse_used, reuse_next };
+		ok = ok && fwrite(slot, sizeof(int), 2, filestream) == 2;
+		ok = ok && fwrite(reuse_count, sizeof(int), reuse, filestream) == (size_t)reuse;
+		ok = ok && fwrite(reuse_level, sizeof(int), reuse, filestream) == (size_t)reuse;
+		ok = ok && fwrite(reuse_sigma, sizeof(mjtNum), reuse, filestream) == (size_t)reuse;
+		ok = ok && fwrite(reuse_ctrl, sizeof(mjtNum), (size_t)reuse * ptbdim, filestream) == (size_t)reuse * ptbdim;
+		ok = ok && fwrite(reuse_ptb, sizeof(mjtNum), (size_t)reuse * ptbnum * ptbdim, filestream) == (size_t)reuse * ptbnum * ptbdim;
+		ok = ok && fwrite(reuse_cost, sizeof(mjtNum), (size_t)reuse * ptbnum, filestream) == (size_t)reuse * ptbnum;
+	}
+	ok = (fflush(filestream) == 0) && ok;
+	ok = (fclose(filestream) == 0) && ok;
+	if (!ok || !MoveFileEx(tempname, filename, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+		printf("Could not write checkpoint: %s\n", filename);
+		return false;
+	}
+	return true;
+}
+
+// restore the state saved by saveCheckpoint, the seed of the checkpoint replaces the current one
+bool loadCheckpoint(int id, int niteration)
+{
+	char filename[30];
+	CheckpointHeader header;
+	mjtNum scalar[5];
+	FILE *filestream;
+	bool ok;
+
+	snprintf(filename, sizeof(filename), "%s%d%s", "checkpoint", id, ".bin");
+	if ((filestream = fopen(filename, "rb")) == NULL) {
+		printf("Could not open file: %s\n", filename);
+		return false;
+	}
+	ok = fread(&header, sizeof(header), 1, filestream) == 1;
+	if (!ok || strcmp(header.magic, "D2CCKPT") != 0 || header.version != 6 ||
+		header.stepnum != stepnum || header.actuatornum != actuatornum || header.ptbdim != ptbdim ||
+		header.rolloutnum_train != rolloutnum_train || header.engine != engine || header.update_rule != update_rule ||
+		header.basis != basis || header.basisnum != basisnum || header.antithetic != antithetic || header.qmc != qmc ||
+		header.windownum != windownum || header.window_tail != window_tail ||
+		header.fidelity_levels != fidelity_levels || header.fidelity_factor != fidelity_factor || header.init_num != init_num ||
+		header.reuse != reuse || header.reuse_fresh != reuse_fresh ||
+		header.train_index >= TRAINING_NUM || header.iteration_index > niteration) {
+		printf("Checkpoint %s does not match the current settings\n", filename);
+		fclose(filestream);
+		return false;
+	}
+	ok = fread(scalar, sizeof(mjtNum), 5, filestream) == 5;
+	ok = ok && fread(ctrl_current, sizeof(mjtNum), actuatornum * stepnum, filestream) == (size_t)(actuatornum * stepnum);
+	ok = ok && fread(ctrl_best, sizeof(mjtNum), actuatornum * stepnum, filestream) == (size_t)(actuatornum * stepnum);
+	ok = ok && fread(update_m, sizeof(mjtNum), ptbdim, filestream) == (size_t)ptbdim;
+	ok = ok && fread(update_v, sizeof(mjtNum), ptbdim, filestream) == (size_t)ptbdim;
+	if (engine) {
+		ok = ok && fread(search_std, sizeof(mjtNum), ptbdim, filestream) == (size_t)ptbdim;
+		ok = ok && fread(cma_c, sizeof(mjtNum), ptbdim, filestream) == (size_t)ptbdim;
+		ok = ok && fread(cma_ps, sizeof(mjtNum), ptbdim, filestream) == (size_t)ptbdim;
+		ok = ok && fread(cma_pc, sizeof(mjtNum), ptbdim, filestream) == (size_t)ptbdim;
+	}
+	ok = ok && fread(nominal_cost.data(), sizeof(mjtNum), header.iteration_index, filestream) == (size_t)header.iteration_index;
+	if (reuse) {
+		int slot[2];
+		ok = ok && fread(slot, sizeof(int), 2, filestream) == 2;
+		ok = ok && fread(reuse_count, sizeof(int), reuse, filestream) == (size_t)reuse;
+		ok = ok && fread(reuse_level, sizeof(int), reuse, filestream) == (size_t)reuse;
+		ok = ok && fread(reuse_sigma, sizeof(mjtNum), reuse, filestream) == (size_t)reuse;
+		ok = ok && fread(reuse_ctrl, sizeof(mjtNum), (size_t)reuse * ptbdim, filestream) == (size_t)reuse * ptbdim;
+		ok = ok && fread(reuse_ptb, sizeof(mjtNum), (size_t)reuse * ptbnum * ptbdim, filestream) == (size_t)reuse * ptbnum * ptbdim;
+		ok = ok && fread(reuse_cost, sizeof(mjtNum), (size_t)reuse * ptbnum, filestream) == (size_t)reuse * ptbnum;
+		reuse_used = slot[0];
+		reuse_next = slot[1];
+	}
+	fclose(filestream);
+	if (!ok) {
+		printf("Checkpoint %s is truncated\n", filename);
+		return false;
+	}
+	update_coefficient = scalar[0];
+	perturb_coefficient_train = scalar[1];
+	line_lr = scalar[2];
+	search_sigma = scalar[3];
+	best_cost = scalar[4];
+	seed = header.seed;
+	resume_train = header.train_index;
+	resume_iteration = header.iteration_index;
+	fidelity_level = header.fidelity_level;
+	level_start = header.level_start;
+	return true;
+}
+
 void train(int id, int niteration)
 {
     static char str1[30];
     static char costfilename[30];
-	FILE *filestream1;
+	const SearchEngine* search = search_engine + engine;
+	FILE *filestream1, *configstream = NULL;
+	int ndim = actuatornum * stepnum;
 
-    RowVectorXd nominal_cost(niteration);
-
-    srand((unsigned)time(NULL) + id);
-	for (int train_index = 0; train_index < TRAINING_NUM; train_index++) {
-		// task initialization
-		mju_copy(ctrl_current[id], ctrl_init, actuatornum*stepnum);  
-		perturb_coefficient_train[id] = perturb_coefficient_train_init;
-		update_coefficient[id] = update_coefficient_init;
+	for (int train_index = resume ? resume_train : 0; train_index < TRAINING_NUM; train_index++) {
+		// task initialization, the state of a resumed task comes from the checkpoint
+		bool resumed = resume && train_index == resume_train;
+		int iteration_start = resumed ? resume_iteration : 0;
+		if (!resumed) {
+			mju_copy(ctrl_current, ctrl_init, ndim);
+			perturb_coefficient_train = perturb_coefficient_train_init;
+			update_coefficient = update_coefficient_init;
+			line_lr = update_coefficient_init;
+			search->reset();
+			mju_copy(ctrl_best, ctrl_init, ndim);
+			best_cost = mjMAXVAL;
+			fidelity_level = fidelity_levels - 1;
+			level_start = 0;
+			reuse_used = reuse_next = 0;
+		}
+		setFidelity(fidelity_level);
 		printfraction = 0.2;
+		while (iteration_start > 0 && iteration_start >= niteration * printfraction) printfraction += 0.2;
+
+		// nominal episodic cost of every iteration is appended to the cost file as the task runs
+		snprintf(costfilename, sizeof(costfilename), "%s%d%s", "cost", id, ".txt");
+		char filemode[5] = "wt+";
+		if (TRAINING_NUM > 1) strcpy(filemode, "at+");
+		if (mpc_horizon) filestream1 = NULL;
+		else if ((filestream1 = fopen(costfilename, filemode)) == NULL)
+			printf("Could not open file: %s\n", costfilename);
+		if (confignum && !mpc_horizon) {
+			// nominal cost under every extra configuration, one line per iteration starting with the iteration index
+			snprintf(costfilename, sizeof(costfilename), "%s%d%s", "costconfig", id, ".txt");
+			if ((configstream = fopen(costfilename, resumed || TRAINING_NUM > 1 ? "at+" : "wt+")) == NULL)
+				printf("Could not open file: %s\n", costfilename);
+			snprintf(costfilename, sizeof(costfilename), "%s%d%s", "cost", id, ".txt");
+		}
+		for (int iteration_index = 0; filestream1 && iteration_index < iteration_start; iteration_index++) {
+			sprintf(str1, "%5.0f", nominal_cost(iteration_index));
+			fwrite(str1, 5, 1, filestream1);
+			fputs(" ", filestream1);
+		}
 
 		// run and time
-		double start = gettm();
-		for (int iteration_index = 0; iteration_index < niteration; iteration_index++)
+		double start = gettm(), previous = start;
+		mjtNum longest = 0;
+		const char* stop = NULL;
+		if (deadline > 0 && iteration_estimate > deadline) stop = "deadline";
+		iteration_done = iteration_start;
+		for (int iteration_index = iteration_start; iteration_index < niteration && !stop; iteration_index++)
 		{
-			// nominal
-			nominal_cost(iteration_index) = 0;
-			modelInit(m, d[id], state_nominal[0]);
-			for (int step_index = 0; step_index < stepnum; step_index++) {
-				for (int i = 0; i < actuatornum; i++) d[id]->ctrl[i] = ctrl_current[id][step_index * actuatornum + i];
-				nominal_cost(iteration_index) += stepCost(m, d[id], step_index);
-				for (int i = 0; i < integration_per_step; i++) mj_step(m, d[id]);
-				mj_forward(m, d[id]);
-			}
-			nominal_cost(iteration_index) += stepCost(m, d[id], stepnum);
-
-            // calculate gradient and update control
-            for (int rollout_index = 0; rollout_index < rolloutnum_train; rollout_index++)
-            {
-                for (int i = 0; i < stepnum * actuatornum; i++) delta_u[id][i] = perturb_coefficient_train[id] * randGauss(0, 1);
-                mjtNum rollout_cost = 0;
-                
-				modelInit(m, d[id], state_nominal[0]);
-                for (int step_index = 0; step_index < stepnum; step_index++) {
-                    for (int i = 0; i < actuatornum; i++) d[id]->ctrl[i] = ctrl_current[id][step_index * actuatornum + i] + delta_u[id][step_index * actuatornum + i];
-                    rollout_cost += stepCost(m, d[id], step_index);
-                    for (int i = 0; i < integration_per_step; i++) mj_step(m, d[id]);
-					mj_forward(m, d[id]);
-                }
-                rollout_cost += stepCost(m, d[id], stepnum);
-
-                // gradient
-                for (int i = 0; i < actuatornum * stepnum; i++)
-                {
-                    gradient[id][i] = gradient[id][i] * (1 - 1 / (rollout_index + 1.0)) + (rollout_cost - nominal_cost(iteration_index)) * delta_u[id][i] / ((rollout_index + 1.0)*perturb_coefficient_train[id]*perturb_coefficient_train[id]);
-                }
-                if (id == 0) {
-                    sprintf(str1, "%3.3f", gradient[id][2]);
-                    fwrite(str1, 5, 1, filestream2);
-                    fputs(" ", filestream2);
-                }
-            }
-			if (id == 0) fputs("\n", filestream2);
+			// nominal and perturbed rollouts of this iteration on all workers
+			batch_iteration = batch_offset + train_index * niteration + iteration_index;
+			if (qmc) sobolPointOrder(seed, batch_iteration, qmc_order, ptbnum, sobolChunkNum(ptbdim));
 
-            // update
-            for (int i = 0; i < actuatornum * stepnum; i++)
-            {
-                if (update_coefficient[id] * gradient[id][i] > kMaxUpdate) ctrl_current[id][i] -= kMaxUpdate;
-                else if (update_coefficient[id] * gradient[id][i] < -kMaxUpdate) ctrl_current[id][i] -= -kMaxUpdate;
-				else ctrl_current[id][i] -= update_coefficient[id] * gradient[id][i];
-                gradient[id][i] = 0;
-            }
-			ctrlLimit(ctrl_current[id], actuatornum * stepnum);
+			// a batch simulates only reuse_fresh perturbations if the stored ones keep enough effective samples
+			batch_fresh = ptbnum;
+			reuse_on = false;
+			if (reuse_used && reuseWeights(reuse_fresh) >= reuse_ess * ptbnum) {
+				reuse_on = true;
+				batch_fresh = reuse_fresh;
+				reuse_batches++;
+				reuse_saved += stepScale() * (ptbnum - batch_fresh) * init_num;
+			}
+			if (windownum) {
+				runBatch(rolloutJob, 1);
+				runBatch(windowJob, ptbnum);
+			}
+			else runRollouts();
+			nominal_cost(iteration_index) = batch_nominal_cost;
+			if (filestream1) {
+				sprintf(str1, "%5.0f", nominal_cost(iteration_index));
+				fwrite(str1, 5, 1, filestream1);
+				fputs(" ", filestream1);
+				fflush(filestream1);
+			}
+			if (configstream) {
+				fprintf(configstream, "%d", iteration_index);
+				for (int k = 0; k < confignum; k++) fprintf(configstream, " %.6g", config_cost[k]);
+				fputs("\n", configstream);
+				fflush(configstream);
+			}
+			rollout_total += stepScale() * init_num;
+			if (windownum)
+				for (int ptb_index = 0; ptb_index < ptbnum; ptb_index++) {
+					int begin, end;
+					windowRange(ptb_index % windownum, &begin, &end);
+					rollout_total += stepScale() * (rolloutnum_train / ptbnum) * (end - begin) / (double)stepnum;
+				}
+			else rollout_total += stepScale() * batch_fresh * (rolloutnum_train / ptbnum) * init_num;
+			if (nominal_cost(iteration_index) < best_cost) {
+				best_cost = nominal_cost(iteration_index);
+				mju_copy(ctrl_best, ctrl_current, ndim);
+			}
+
+            // update: step of the search engine, expanded to every control step
+			if (basis) {
+				search->update(gradient, iteration_index, niteration);
+				basisExpand(ctrl_step, gradient);
+			}
+			else search->update(ctrl_step, iteration_index, niteration);
+
+			// coarse level: compare the nominal cost with the next finer level, move there when they disagree or the level is used up
+			mjtNum reference_cost = nominal_cost(iteration_index);
+			if (fidelity_level > 0) {
+				int level_iteration = iteration_index + 1 - level_start;
+				bool level_end = level_iteration >= fidelity_iter;
+				if (level_end || level_iteration % fidelity_check == 0) {
+					setFidelity(fidelity_level - 1);
+					runNominal();
+					rollout_total += stepScale() * init_num;
+					bool agree = mju_abs(reference_cost - batch_nominal_cost) <= fidelity_tol * mju_abs(batch_nominal_cost);
+					if (agree && !level_end) setFidelity(fidelity_level + 1);
+					else {
+						printf("\nFidelity level %d -> %d after iteration %d: cost %.2f -> %.2f%s\n", fidelity_level + 1, fidelity_level,
+							iteration_index + 1, reference_cost, batch_nominal_cost, agree ? "" : " (disagree)");
+						reference_cost = best_cost = batch_nominal_cost;
+						mju_copy(ctrl_best, ctrl_current, ndim);
+						level_start = iteration_index + 1;
+					}
+				}
+			}
+
+			if (line_search) {
+				// try all step sizes in parallel, keep the best if it improves on the nominal cost and center the next search on it
+				runLineSearch();
+				rollout_total += stepScale() * line_search * init_num;
+				int best = 0;
+				for (int k = 1; k < line_search; k++)
+					if (line_cost[k] < line_cost[best]) best = k;
+				if (line_cost[best] < reference_cost) {
+					mju_addTo(ctrl_current, line_delta + (size_t)best * ndim, ndim);
+					line_lr = update_coefficient * lineFactor(best);
+				}
+				else line_lr = update_coefficient * lineFactor(0);
+			}
+			else ctrlStep(ctrl_current, ctrl_step, 1, kMaxUpdate, ndim);
             
-            // print '.' every printfraction of niteration for thread 0
-            if (id == 0 && iteration_index >= niteration * printfraction)
+            // print '.' every printfraction of niteration
+            if (!mpc_horizon && iteration_index >= niteration * printfraction)
             {
                 printf(".");
                 printfraction += 0.2;
             }
-            //if (iteration_index > 150) { update_coefficient = 0.00001; perturb_coefficient_train = 0.01; }
-            //if (iteration_index > 600) { update_coefficient = 0.00001; perturb_coefficient_train = 0.01; }
+
+			// checkpoint the state for the next iteration
+			if (checkpoint_every > 0 && (iteration_index + 1) % checkpoint_every == 0)
+				saveCheckpoint(id, train_index, iteration_index + 1);
+
+			// stopping criteria: best cost stalled over the window of this level, small gradient, next iteration would miss the deadline
+			mjtNum elapsed = gettm() - start;
+			longest = mjMAX(longest, gettm() - previous);
+			previous = gettm();
+			if (stop_window > 0 && iteration_index - level_start >= stop_window) {
+				mjtNum window_cost = nominal_cost.segment(level_start, iteration_index - stop_window + 1 - level_start).minCoeff();
+				if (window_cost - best_cost < stop_rel * mju_abs(window_cost))
+					stop = "cost improvement below stop_rel";
+			}
+			if (stop_grad > 0 && engine == 0 && gradient_norm < stop_grad)
+				stop = "gradient norm below stop_grad";
+			if (deadline > 0 && elapsed + longest > deadline)
+				stop = "deadline";
+			iteration_done = iteration_index + 1;
+			if (stop && !mpc_horizon)
+				printf("\nStopped after %d iterations: %s\n", iteration_index + 1, stop);
         }
-        simtime[id] = gettm() - start;
-        
-		// save nominal episodic cost of every iteration to file
-		snprintf(costfilename, sizeof(costfilename), "%s%d%s", "cost", id, ".txt");
-		char filemode[5] = "wt+";
-		if (TRAINING_NUM > 1) strcpy(filemode, "at+");
-		if ((filestream1 = fopen(costfilename, filemode)) != NULL) {
-			for (int iteration_index = 0; iteration_index < niteration; iteration_index++) {
-				sprintf(str1, "%5.0f", nominal_cost(iteration_index));
-				fwrite(str1, 5, 1, filestream1);
-				fputs(" ", filestream1);
+
+		// the best control of a coarse level is compared at level 0. An MPC replan ends with the best simulated
+		// control instead, so no rollouts run after the deadline check
+		if (mpc_horizon) {
+			setFidelity(0);
+			mju_copy(ctrl_current, ctrl_best, ndim);
+		}
+		else if (fidelity_level > 0) {
+			setFidelity(0);
+			mju_copy(ctrl_step, ctrl_current, ndim);
+			mju_copy(ctrl_current, ctrl_best, ndim);
+			runNominal();
+			rollout_total += init_num;
+			best_cost = batch_nominal_cost;
+			mju_copy(ctrl_current, ctrl_step, ndim);
+		}
+
+		// the last update has not been simulated yet, keep the best control
+		if (!mpc_horizon) {
+			runNominal();
+			rollout_total += init_num;
+			if (batch_nominal_cost < best_cost) {
+				best_cost = batch_nominal_cost;
+				mju_copy(ctrl_best, ctrl_current, ndim);
 			}
+			mju_copy(ctrl_current, ctrl_best, ndim);
+			printf("\nBest nominal cost: %.2f\n", best_cost);
+		}
+
+		// score the best control under every extra configuration
+		if (confignum && !mpc_horizon) {
+			runNominal();
+			rollout_total += init_num;
+			for (int k = 0; k < confignum; k++)
+				printf("Cost configuration %d (Q %g, QT %g, R %g): %.2f\n", k, cost_config[k].Q, cost_config[k].QT, cost_config[k].R, config_cost[k]);
+		}
+		if (configstream) fclose(configstream);
+        simtime[id] = gettm() - start;
+		if (filestream1) {
 			fputs("\n", filestream1);
 			fclose(filestream1);
 		}
-		else printf("Could not open file: cost.txt\n");
     } 
 }
 
+// diagonal state weight matrices from Q and QT
+void costMatrices(void)
+{
+	for (int i = 0; i < 2 * dof + quatnum; i++)
+	{
+		QTm[i][i] = 1 * QT;
+		Qm[i][i] = 1 * Q;
+	}
+}
+
+// sweep key index of a parameters.txt key, -1 if it cannot be swept
+int sweepKey(const char* key)
+{
+	if (strcmp(key, "Q:") == 0 || strcmp(key, "Q_diag:") == 0) return 0;
+	if (strcmp(key, "QT:") == 0) return 1;
+	if (strcmp(key, "R:") == 0) return 2;
+	if (strcmp(key, "ptb_coef:") == 0) return 3;
+	if (strcmp(key, "step_coef:") == 0) return 4;
+	return -1;
+}
+
+// read the sweep specification: one "key: values" line per swept key, the other keys keep their parameters.txt value
+// grid: every combination of the listed values; "random: N": N samples with every key uniform in "key: lo hi [log]"
+bool readSweep(const char* filename)
+{
+	char line[1000];
+	mjtNum list[5][kMaxSweep];
+	int count[5] = { 0 };
+	bool logscale[5] = { false };
+	FILE *filestream;
+
+	if ((filestream = fopen(filename, "r")) == NULL) {
+		printf("Could not open file: %s\n", filename);
+		return false;
+	}
+	while (fgets(line, sizeof(line), filestream)) {
+		char *token = strtok(line, " \t\r\n");
+		if (!token || token[0] == '#') continue;
+		if (strcmp(token, "random:") == 0) {
+			if ((token = strtok(NULL, " \t\r\n"))) sweep_random = atoi(token);
+			continue;
+		}
+		int k = sweepKey(token);
+		if (k < 0) {
+			printf("Unknown sweep key: %s\n", token);
+			fclose(filestream);
+			return false;
+		}
+		count[k] = 0;
+		while ((token = strtok(NULL, " \t\r\n")) && count[k] < kMaxSweep) {
+			if (strcmp(token, "log") == 0) logscale[k] = true;
+			else list[k][count[k]++] = atof(token);
+		}
+	}
+	fclose(filestream);
+
+	mjtNum current[5] = { Q, QT, R, perturb_coefficient_train_init, update_coefficient_init };
+	if (sweep_random > 0) {
+		// uniform samples are the normal CDF of Gaussian samples from the sweep stream
+		RandStream stream;
+		mjtNum g[5];
+		sweepnum = mjMIN(sweep_random, kMaxSweep);
+		randStreamInit(&stream, seed, 0xFFFFFFFE);
+		for (int j = 0; j < sweepnum; j++) {
+			randGaussFill(&stream, g, 5);
+			for (int k = 0; k < 5; k++) {
+				mjtNum u = 0.5 * erfc(-g[k] / sqrt(2.0));
+				if (count[k] >= 2 && logscale[k] && list[k][0] > 0 && list[k][1] > 0)
+					sweep_value[j][k] = list[k][0] * pow(list[k][1] / list[k][0], u);
+				else if (count[k] >= 2)
+					sweep_value[j][k] = list[k][0] + u * (list[k][1] - list[k][0]);
+				else sweep_value[j][k] = count[k] ? list[k][0] : current[k];
+			}
+		}
+	}
+	else {
+		// grid, the last key changes fastest
+		sweepnum = 1;
+		for (int k = 0; k < 5; k++) {
+			if (sweepnum * mjMAX(1, count[k]) > kMaxSweep) {
+				printf("The sweep grid has more than %d configurations\n", kMaxSweep);
+				return false;
+			}
+			sweepnum *= mjMAX(1, count[k]);
+		}
+		for (int j = 0; j < sweepnum; j++)
+			for (int k = 4, rest = j; k >= 0; k--) {
+				int n = mjMAX(1, count[k]);
+				sweep_value[j][k] = count[k] ? list[k][rest % n] : current[k];
+				rest /= n;
+			}
+	}
+	return true;
+}
+
+// set the hyperparameters of sweep configuration j
+void sweepSet(int j)
+{
+	Q = sweep_value[j][0];
+	QT = sweep_value[j][1];
+	R = sweep_value[j][2];
+	perturb_coefficient_train_init = sweep_value[j][3];
+	update_coefficient_init = sweep_value[j][4];
+	costMatrices();
+}
+
+// train every sweep configuration on the shared model and workers, write one row per configuration to sweep0.txt
+// the best control of every configuration is scored once more with the Q, QT and R of parameters.txt, since costs
+// under different swept weights are not comparable. afterwards ctrl_current and the hyperparameters are those of
+// the configuration with the lowest reference cost
+void runSweep(int niteration)
+{
+	mjtNum *sweep_ctrl = new mjtNum[actuatornum * stepnum];
+	mjtNum sweep_cost = mjMAXVAL, reference[3] = { Q, QT, R };
+	int sweep_best = 0;
+	FILE *filestream;
+
+	if ((filestream = fopen("sweep0.txt", "wt+")) == NULL)
+		printf("Could not open file: sweep0.txt\n");
+	if (filestream) fprintf(filestream, "config Q QT R ptb_coef step_coef best_cost reference_cost iterations time\n");
+	for (int j = 0; j < sweepnum; j++) {
+		sweepSet(j);
+		printf("\nSweep %d/%d: Q %g, QT %g, R %g, ptb_coef %g, step_coef %g\n", j + 1, sweepnum, Q, QT, R,
+			perturb_coefficient_train_init, update_coefficient_init);
+		train(0, niteration);
+
+		// reference cost of the best control
+		Q = reference[0];
+		QT = reference[1];
+		R = reference[2];
+		costMatrices();
+		runNominal();
+		mjtNum reference_cost = batch_nominal_cost;
+		sweepSet(j);
+		printf("Reference cost: %.2f\n", reference_cost);
+		if (filestream) {
+			fprintf(filestream, "%d %g %g %g %g %g %.4f %.4f %d %.3f\n", j, Q, QT, R, perturb_coefficient_train_init,
+				update_coefficient_init, best_cost, reference_cost, iteration_done, simtime[0]);
+			fflush(filestream);
+		}
+		if (reference_cost < sweep_cost) {
+			sweep_cost = reference_cost;
+			sweep_best = j;
+			mju_copy(sweep_ctrl, ctrl_current, actuatornum * stepnum);
+		}
+	}
+	if (filestream) fclose(filestream);
+
+	sweepSet(sweep_best);
+	mju_copy(ctrl_current, sweep_ctrl, actuatornum * stepnum);
+	printf("\nBest sweep configuration: %d, reference cost %.2f\n", sweep_best, sweep_cost);
+	delete[] sweep_ctrl;
+}
+
+// receding-horizon control: every step runs niteration iterations over mpc_horizon steps from the plant state,
+// warm started from the shifted plan, then applies the first control to the plant
+// the executed controls end in ctrl_current, the latency of every replan is written to mpc0.txt
+void runMPC(int niteration)
+{
+	int fullstep = stepnum;
+	int ndim = actuatornum * fullstep;
+	mjtNum *plan = new mjtNum[ndim];
+	mjtNum *plan_init = new mjtNum[ndim];
+	mjData *plant = mj_makeData(m);
+	mjtNum budget = mpc_budget / 1000;
+	mjtNum latency_sum = 0, latency_max = 0, plant_cost = 0, progress = 0.2;
+	double rollout_count = 0;
+	int miss = 0;
+	FILE *filestream;
+
+	mju_copy(plan, ctrl_init, ndim);
+	mju_copy(plan_init, ctrl_init, ndim);
+	modelInit(m, plant, init_state);
+	rollout_start = plant;
+	if (budget > 0) deadline = deadline > 0 ? mjMIN(deadline, budget) : budget;
+	if ((filestream = fopen("mpc0.txt", "wt+")) == NULL)
+		printf("Could not open file: mpc0.txt\n");
+	if (filestream) fprintf(filestream, "step latency_ms iterations plan_cost\n");
+
+	for (int t = 0; t < fullstep; t++) {
+		// replan the remaining horizon from the plant state
+		stepnum = mjMIN(mpc_horizon, fullstep - t);
+		ptbdim = actuatornum * stepnum;
+		mju_copy(ctrl_init, plan + t * actuatornum, ptbdim);
+		batch_offset = t * niteration * TRAINING_NUM;
+		double before = rollout_total;
+		mjtNum start = gettm();
+		train(0, niteration);
+		mjtNum latency = gettm() - start;
+		rollout_count += rollout_total - before;
+		rollout_total = before + (rollout_total - before) * stepnum / fullstep;
+		mju_copy(plan + t * actuatornum, ctrl_current, ptbdim);
+
+		latency_sum += latency;
+		latency_max = mjMAX(latency_max, latency);
+		if (budget > 0 && latency > budget) miss++;
+		if (iteration_done > 0) iteration_estimate = latency / iteration_done;
+		if (filestream && iteration_done > 0) fprintf(filestream, "%d %.3f %d %.4f\n", t, 1000 * latency, iteration_done, best_cost);
+		else if (filestream) fprintf(filestream, "%d %.3f 0 -\n", t, 1000 * latency);
+		if (t >= fullstep * progress) {
+			printf(".");
+			progress += 0.2;
+		}
+
+		// apply the first control, the plant cost uses the whole horizon
+		stepnum = fullstep;
+		mju_copy(plant->ctrl, plan + t * actuatornum, actuatornum);
+		plant_cost += stepCost(m, plant, t);
+		controlStep(m, plant);
+	}
+	plant_cost += stepCost(m, plant, fullstep);
+	if (filestream) fclose(filestream);
+
+	stepnum = fullstep;
+	ptbdim = ndim;
+	batch_offset = 0;
+	rollout_start = NULL;
+	iteration_estimate = 0;
+	mju_copy(ctrl_current, plan, ndim);
+	mju_copy(ctrl_init, plan_init, ndim);
+	printf("\n\n MPC replans          : %d\n", fullstep);
+	printf(" Replan latency       : %.3f ms mean, %.3f ms max\n", 1000 * latency_sum / fullstep, 1000 * latency_max);
+	if (budget > 0)
+		printf(" Over budget          : %d of %d replans\n", miss, fullstep);
+	printf(" Rollouts per second  : %.0f\n", rollout_count / latency_sum);
+	printf(" Closed-loop cost     : %.2f\n", plant_cost);
+	mj_deleteData(plant);
+	delete[] plan;
+	delete[] plan_init;
+}
+
 // main function
 int main(int argc, const char** argv)
 {
 	char str2[30];
+
+	// strip the --resume and --sweep options, the other arguments are positional
+	int narg = 0;
+	for (int i = 0; i < argc; i++) {
+		if (strcmp(argv[i], "--resume") == 0) resume = true;
+		else if (strcmp(argv[i], "--sweep") == 0 && i + 1 < argc) strncpy(sweepfilename, argv[++i], sizeof(sweepfilename) - 1);
+		else argv[narg++] = argv[i];
+	}
+	argc = narg;
 	
     // print help if arguments are missing
     if( argc<3 || argc>8 )
-        return finish("\n Usage: openloop modelfile control_timestep stepnum niteration [model [nthread [profile]]]\n");
+        return finish("\n Usage: openloop modelfile control_timestep stepnum niteration [model [nthread [profile]]] [--resume] [--sweep file]\n");
+    if (resume && sweepfilename[0])
+        return finish("A sweep cannot be resumed");
 	
     // activate MuJoCo Pro license (this must be *your* activation key)
 	DWORD usernamesize = 30;
@@ -225,7 +1489,7 @@ int main(int argc, const char** argv)
 	modelSelection(modelname);
 	
     // read niteration and nthread
-    int niteration = 0, nthread = 0, profile = 0;
+    int niteration = 0, profile = 0;
 	if (sscanf(argv[2], "%lf", &control_timestep) != 1 || control_timestep <= 0)
 		return finish("Invalid control_timestep argument");
 	if (sscanf(argv[3], "%d", &stepnum) != 1 || stepnum <= 0)
@@ -259,12 +1523,22 @@ int main(int argc, const char** argv)
         m = mj_loadXML(modelfilename, 0, error, 500);
     if( !m )
         return finish(error);
+    if (modelDimension(m) != 1)
+        return finish("Unknown model or model dimension over kMaxState", m);
+    size_t nctrl = (size_t)stepnum * actuatornum;
+    ctrl_current = alignedAlloc(nctrl);
+    ctrl_init = alignedAlloc(nctrl);
+    gradient = alignedAlloc(nctrl);
+    ctrl_step = alignedAlloc(nctrl);
+    ctrl_best = alignedAlloc(nctrl);
+    if (!ctrl_current || !ctrl_init || !gradient || !ctrl_step || !ctrl_best)
+        return finish("Could not allocate the control sequences", m);
 
-	// check timestep setting
-	simulation_timestep = m->opt.timestep;
-	integration_per_step = (int)(control_timestep / simulation_timestep);
-	if (integration_per_step <= 0)
-		return finish("Invalid timestep setting");
+    // check timestep setting
+    simulation_timestep = m->opt.timestep;
+    integration_per_step = (int)(control_timestep / simulation_timestep);
+    if (integration_per_step <= 0)
+        return finish("Invalid timestep setting");
 	
     // make per-thread data
     int testkey = mj_name2id(m, mjOBJ_KEY, "test");
@@ -286,66 +1560,459 @@ int main(int argc, const char** argv)
 	
 	// save gradient value to file for convergence checking
 	strcpy(datafilename, "converge.txt");
-	if ((filestream2 = fopen(datafilename, "wt+")) == NULL) {
+	if ((filestream2 = fopen(datafilename, resume ? "at+" : "wt+")) == NULL) {
 		printf("Could not open file: converge.txt\n");
 	}
 	// read cost parameters for the open-loop training
+	seed = (uint64_t)time(NULL);
 	strcpy(datafilename, "parameters.txt");
 	if ((filestream3 = fopen(datafilename, "r")) != NULL) {
-		while (!feof(filestream3))
+		while (fscanf(filestream3, "%s", data_buff) == 1)
 		{
-			fscanf(filestream3, "%s", data_buff);
-			if (data_buff[1] == '_')
+			if (strcmp(data_buff, "seed:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				seed = strtoull(data_buff, NULL, 10);
+			}
+			else if (strcmp(data_buff, "antithetic:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				antithetic = atoi(data_buff);
+			}
+			else if (strcmp(data_buff, "qmc:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				qmc = atoi(data_buff);
+			}
+			else if (strcmp(data_buff, "basis:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				if (_strcmpi(data_buff, "bspline") == 0) basis = 1;
+				else if (_strcmpi(data_buff, "dct") == 0) basis = 2;
+				else basis = 0;
+			}
+			else if (strcmp(data_buff, "basis_num:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				basisnum = atoi(data_buff);
+			}
+			else if (strcmp(data_buff, "update:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				if (_strcmpi(data_buff, "nesterov") == 0) update_rule = 1;
+				else if (_strcmpi(data_buff, "rmsprop") == 0) update_rule = 2;
+				else if (_strcmpi(data_buff, "adam") == 0) update_rule = 3;
+				else update_rule = 0;
+			}
+			else if (strcmp(data_buff, "momentum:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				momentum = atof(data_buff);
+			}
+			else if (strcmp(data_buff, "beta1:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				beta1 = atof(data_buff);
+			}
+			else if (strcmp(data_buff, "beta2:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				beta2 = atof(data_buff);
+			}
+			else if (strcmp(data_buff, "lr_schedule:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				if (_strcmpi(data_buff, "step") == 0) lr_schedule = 1;
+				else if (_strcmpi(data_buff, "exp") == 0) lr_schedule = 2;
+				else if (_strcmpi(data_buff, "cosine") == 0) lr_schedule = 3;
+				else lr_schedule = 0;
+			}
+			else if (strcmp(data_buff, "lr_decay:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				lr_decay = atof(data_buff);
+			}
+			else if (strcmp(data_buff, "lr_step:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				lr_step = atoi(data_buff);
+			}
+			else if (strcmp(data_buff, "optimizer:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				if (_strcmpi(data_buff, "cmaes") == 0) engine = 1;
+				else if (_strcmpi(data_buff, "cem") == 0) engine = 2;
+				else engine = 0;
+			}
+			else if (strcmp(data_buff, "cem_elite:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				cem_elite = atof(data_buff);
+			}
+			else if (strcmp(data_buff, "cem_smooth:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				cem_smooth = atof(data_buff);
+			}
+			else if (strcmp(data_buff, "checkpoint:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				checkpoint_every = atoi(data_buff);
+			}
+			else if (strcmp(data_buff, "stop_window:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				stop_window = atoi(data_buff);
+			}
+			else if (strcmp(data_buff, "stop_rel:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				stop_rel = atof(data_buff);
+			}
+			else if (strcmp(data_buff, "stop_grad:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				stop_grad = atof(data_buff);
+			}
+			else if (strcmp(data_buff, "deadline:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				deadline = atof(data_buff);
+			}
+			else if (strcmp(data_buff, "window_num:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				windownum = atoi(data_buff);
+			}
+			else if (strcmp(data_buff, "window_tail:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				window_tail = atoi(data_buff);
+			}
+			else if (strcmp(data_buff, "warm_start:") == 0)
+			{
+				fscanf(filestream3, "%99s", warmfilename);
+			}
+			else if (strcmp(data_buff, "warm_interp:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				warm_spline = _strcmpi(data_buff, "spline") == 0 ? 1 : 0;
+			}
+			else if (strcmp(data_buff, "fidelity_levels:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				fidelity_levels = atoi(data_buff);
+			}
+			else if (strcmp(data_buff, "fidelity_factor:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				fidelity_factor = atoi(data_buff);
+			}
+			else if (strcmp(data_buff, "fidelity_iter:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				fidelity_iter = atoi(data_buff);
+			}
+			else if (strcmp(data_buff, "fidelity_check:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				fidelity_check = atoi(data_buff);
+			}
+			else if (strcmp(data_buff, "fidelity_tol:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				fidelity_tol = atof(data_buff);
+			}
+			else if (strcmp(data_buff, "init_num:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				init_num = atoi(data_buff);
+			}
+			else if (strcmp(data_buff, "init_spread:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				init_spread = atof(data_buff);
+			}
+			else if (strcmp(data_buff, "init_states:") == 0)
+			{
+				fscanf(filestream3, "%99s", initfilename);
+			}
+			else if (strcmp(data_buff, "cost_config:") == 0)
+			{
+				// Q QT R of an extra configuration, the target is state_target unless cost_target follows
+				mjtNum weight[3] = { 0 };
+				for (int i = 0; i < 3; i++)
+					if (fscanf(filestream3, "%s", data_buff) == 1) weight[i] = atof(data_buff);
+				if (confignum < kMaxConfig) {
+					cost_config[confignum].Q = weight[0];
+					cost_config[confignum].QT = weight[1];
+					cost_config[confignum].R = weight[2];
+					mju_copy(config_target[confignum], state_target, statedim);
+					confignum++;
+				}
+				else printf("Too many cost configurations, at most %d are used\n", kMaxConfig);
+			}
+			else if (strcmp(data_buff, "cost_target:") == 0)
+			{
+				for (int i = 0; i < 2 * dof + quatnum; i++)
+					if (fscanf(filestream3, "%s", data_buff) == 1 && confignum > 0)
+						config_target[confignum - 1][i] = atof(data_buff);
+			}
+			else if (strcmp(data_buff, "mpc_horizon:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				mpc_horizon = mjMAX(0, atoi(data_buff));
+			}
+			else if (strcmp(data_buff, "mpc_budget:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				mpc_budget = atof(data_buff);
+			}
+			else if (strcmp(data_buff, "reuse:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				reuse = mjMAX(0, atoi(data_buff));
+			}
+			else if (strcmp(data_buff, "reuse_fresh:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				reuse_fresh = atoi(data_buff);
+			}
+			else if (strcmp(data_buff, "reuse_ess:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				reuse_ess = atof(data_buff);
+			}
+			else if (strcmp(data_buff, "line_search:") == 0)
+			{
+				fscanf(filestream3, "%s", data_buff);
+				line_search = mjMAX(0, atoi(data_buff));
+			}
+			else if (data_buff[1] == '_')
 			{
 				fscanf(filestream3, "%s", data_buff);
 				Q = atof(data_buff);
 			}
-			if (data_buff[0] == 'R')
+			else if (data_buff[0] == 'R')
 			{
 				fscanf(filestream3, "%s", data_buff);
 				R = atof(data_buff);
 			}
-			if (data_buff[1] == 'T')
+			else if (data_buff[1] == 'T')
 			{
 				fscanf(filestream3, "%s", data_buff);
 				QT = atof(data_buff);
 			}
-			if (data_buff[0] == 'p')
+			else if (data_buff[0] == 'p')
 			{
 				fscanf(filestream3, "%s", data_buff);
 				perturb_coefficient_train_init = atof(data_buff);
 			}
-			if (data_buff[0] == 's')
+			else if (data_buff[0] == 's')
 			{
 				fscanf(filestream3, "%s", data_buff);
 				update_coefficient_init = atof(data_buff);
 			}
 		}
-		for (int i = 0; i < 2*dof+quatnum; i++)
-		{
-			QTm[i][i] = 1 * QT;
-			Qm[i][i] = 1 * Q;
-		}
+		costMatrices();
 		//QTm[0][0] = 3 * QT; Qm[0][0] = 3 * Q; //pendulum
 		//QTm[0][0] = 270; QTm[1][1] = 700; QTm[2][2] = 100; QTm[3][3] = 100; //cartpole
 		//Qm[0][0] = 10 * Q; Qm[1][1] = 0.1 * Q; Qm[2][2] = 0.0 * Q; Qm[3][3] = 1 * Q;
 		//QTm[0][0] = 20*QT; QTm[1][1] = 10*QT; QTm[2][2] = 2*QT; QTm[3][3] = 4*QT;
 		fclose(filestream3);
+
+		// weight matrices of the extra cost configurations, built like Qm and QTm
+		if (confignum) {
+			config_matrix = new mjtNum[(size_t)2 * confignum * statedim * statedim];
+			mju_zero(config_matrix, 2 * confignum * statedim * statedim);
+			for (int k = 0; k < confignum; k++) {
+				mjtNum *qm = config_matrix + (size_t)2 * k * statedim * statedim;
+				mjtNum *qtm = qm + statedim * statedim;
+				for (int i = 0; i < statedim; i++) {
+					qm[i * statedim + i] = cost_config[k].Q;
+					qtm[i * statedim + i] = cost_config[k].QT;
+				}
+				cost_config[k].Qm = qm;
+				cost_config[k].QTm = qtm;
+				cost_config[k].target = config_target[k];
+			}
+		}
 	}
 	else printf("Could not open file: parameters.txt\n");
 
-	// read initial control values
-	strcpy(datafilename, "init.txt");
-	if ((filestream3 = fopen(datafilename, "r")) != NULL)
-	{
-		for (int i = 0; i < actuatornum * stepnum; i++)
+	// read initial control values, or resample a previous result onto the current timestep and horizon
+	if (warmfilename[0]) {
+		mjtNum warm_dt;
+		int warm_stepnum;
+		// the step number in the log sizes the buffer, one spare value detects a longer sequence
+		readResult(warmfilename, NULL, 0, &warm_dt, &warm_stepnum);
+		int warm_max = mjMAX(0, warm_stepnum) * actuatornum + 1;
+		mjtNum *warm_ctrl = new mjtNum[warm_max];
+		int warm_num = readResult(warmfilename, warm_ctrl, warm_max, &warm_dt, &warm_stepnum);
+		if (warm_num <= 0 || warm_dt <= 0 || warm_stepnum <= 0 || warm_num != warm_stepnum * actuatornum) {
+			delete[] warm_ctrl;
+			return finish("Could not warm start, the result file is missing or has a different actuator number", m);
+		}
+		ctrlResample(ctrl_init, stepnum, control_timestep, warm_ctrl, warm_stepnum, warm_dt, actuatornum, warm_spline);
+		ctrlLimit(ctrl_init, actuatornum * stepnum);
+		printf("Warm start from %s: %d steps at dt_c = %g resampled to %d steps at dt_c = %g (%s)\n",
+			warmfilename, warm_stepnum, warm_dt, stepnum, control_timestep, warm_spline ? "spline" : "linear");
+		delete[] warm_ctrl;
+	}
+	else {
+		strcpy(datafilename, "init.txt");
+		if ((filestream3 = fopen(datafilename, "r")) != NULL)
 		{
-			fscanf(filestream3, "%s", data_buff); 
-			ctrl_init[i] = atof(data_buff);
+			for (int i = 0; i < actuatornum * stepnum; i++)
+			{
+				fscanf(filestream3, "%s", data_buff); 
+				ctrl_init[i] = atof(data_buff);
+			}
+			fclose(filestream3);
 		}
+		else printf("Could not open file: init.txt\n");
+	}
+
+	// sample the control basis
+	if (basis == 1 && (basisnum < 4 || basisnum > stepnum))
+		return finish("Invalid basis_num, the B-spline basis needs 4 <= basis_num <= stepnum", m);
+	if (basis == 2 && (basisnum < 1 || basisnum > stepnum))
+		return finish("Invalid basis_num, the DCT basis needs 1 <= basis_num <= stepnum", m);
+	ptbdim = actuatornum * stepnum;
+	if (basis) {
+		ptbdim = actuatornum * basisnum;
+		basis_matrix = new mjtNum[(size_t)stepnum * basisnum];
+		if (basis == 1) bsplineBasis(basis_matrix, stepnum, basisnum);
+		else dctBasis(basis_matrix, stepnum, basisnum);
+		for (int id = 0; id < nthread; id++)
+			ptb_step[id] = new mjtNum[(size_t)stepnum * actuatornum];
+	}
+
+	// initial states: read one per row, or sampled once the seed is known
+	init_state = new mjtNum[(size_t)kMaxInit * statedim];
+	if (initfilename[0]) {
+		int count = 0;
+		if ((filestream3 = fopen(initfilename, "r")) == NULL)
+			return finish("Could not open the initial state file", m);
+		while (count < kMaxInit * statedim && fscanf(filestream3, "%s", data_buff) == 1)
+			init_state[count++] = atof(data_buff);
 		fclose(filestream3);
+		init_num = count / statedim;
+		if (init_num < 1 || count % statedim)
+			return finish("The initial state file needs one state of 2*dof+quatnum values per row", m);
+	}
+	else init_num = mjMAX(1, mjMIN(kMaxInit, init_num));
+
+	// windows of the windowed perturbation and their nominal snapshots
+	if (windownum > 0) {
+		if (engine || basis)
+			return finish("Windowed perturbation needs the gradient engine without a basis", m);
+		if (init_num > 1)
+			return finish("Windowed perturbation needs a single initial state", m);
+		windownum = mjMIN(mjMIN(windownum, kMaxWindow), stepnum);
+		window_len = (stepnum + windownum - 1) / windownum;
+		windownum = (stepnum + window_len - 1) / window_len;
+		for (int window = 0; window < windownum; window++)
+			window_data[window] = mj_makeData(m);
+		nominal_stage = new mjtNum[stepnum + 2];
+	}
+	else windownum = 0;
+
+	// fidelity levels, the coarsest level still takes at least one mj_step per control step
+	integration_fine = integration_per_step;
+	fidelity_factor = mjMAX(2, fidelity_factor);
+	fidelity_levels = mjMAX(1, fidelity_levels);
+	for (int factor = 1, level = 1; level < fidelity_levels; level++) {
+		factor *= fidelity_factor;
+		if (integration_fine / factor < 1) fidelity_levels = level;
+	}
+	if (fidelity_iter <= 0) fidelity_iter = mjMAX(1, niteration / fidelity_levels);
+	fidelity_check = mjMAX(1, fidelity_check);
+
+	// allocate the batch of perturbations, rolloutnum_train is rounded up to whole pairs in antithetic mode
+	ptbnum = antithetic ? (rolloutnum_train + 1) / 2 : rolloutnum_train;
+	rolloutnum_train = antithetic ? 2 * ptbnum : ptbnum;
+	if (windownum > ptbnum)
+		return finish("Every window needs a perturbation, window_num is larger than the number of perturbations", m);
+	delta_u = new mjtNum[(size_t)ptbnum * ptbdim];
+	rollout_cost = new mjtNum[rolloutnum_train];
+	rollout_weight = new mjtNum[ptbnum];
+	if (init_num > 1) {
+		state_cost = new mjtNum[(size_t)mjMAX(rolloutnum_train + 1, line_search) * init_num];
+		state_config_cost = new mjtNum[(size_t)mjMAX(1, confignum) * init_num];
+	}
+	update_m = new mjtNum[ptbdim];
+	update_v = new mjtNum[ptbdim];
+	if (engine) {
+		if (rolloutnum_train < 2)
+			return finish("The population search engines need at least 2 rollouts per iteration", m);
+		if (line_search) {
+			printf("Line search is only used with the gradient engine\n");
+			line_search = 0;
+		}
+		search_std = new mjtNum[ptbdim];
+		cma_c = new mjtNum[ptbdim];
+		cma_ps = new mjtNum[ptbdim];
+		cma_pc = new mjtNum[ptbdim];
+		search_mean = new mjtNum[ptbdim];
+		search_var = new mjtNum[ptbdim];
+		member_order = new int[rolloutnum_train];
+	}
+	if (line_search) {
+		line_delta = new mjtNum[(size_t)line_search * actuatornum * stepnum];
+		line_cost = new mjtNum[line_search];
+	}
+	if (qmc) qmc_order = new int[(size_t)ptbnum * sobolChunkNum(ptbdim)];
+
+	// history of the reused batches, the stored perturbations have to be the controls of every step
+	batch_fresh = ptbnum;
+	if (reuse) {
+		if (engine || basis || windownum || antithetic)
+			return finish("Rollout reuse needs the gradient engine without a basis, windows or antithetic pairs", m);
+		reuse = mjMIN(reuse, kMaxReuse);
+		if (reuse_fresh <= 0) reuse_fresh = ptbnum / 2;
+		reuse_fresh = mjMAX(1, mjMIN(ptbnum, reuse_fresh));
+		reuse_ctrl = new mjtNum[(size_t)reuse * ptbdim];
+		reuse_ptb = new mjtNum[(size_t)reuse * ptbnum * ptbdim];
+		reuse_cost = new mjtNum[(size_t)reuse * ptbnum];
+		reuse_weight = new mjtNum[(size_t)reuse * ptbnum];
+	}
+
+	// sweep configurations
+	if (sweepfilename[0] && !readSweep(sweepfilename))
+		return finish("Could not read the sweep specification", m);
+	if (sweepfilename[0] && checkpoint_every) {
+		printf("Checkpoints are not written during a sweep\n");
+		checkpoint_every = 0;
+	}
+
+	// receding-horizon mode
+	if (mpc_horizon) {
+		if (basis || windownum || init_num > 1 || sweepfilename[0] || resume)
+			return finish("MPC mode needs the whole-horizon parameterization, a single initial state, no sweep and no resume", m);
+		mpc_horizon = mjMIN(mpc_horizon, stepnum);
+		checkpoint_every = 0;
+	}
+
+	// cost history and the checkpoint to resume from
+	nominal_cost.resize(niteration);
+	if (resume) {
+		if (!loadCheckpoint(0, niteration))
+			return finish("Could not resume training", m);
+		printf("Resuming task %d at iteration %d\n", resume_train, resume_iteration);
+	}
+
+	// sampled initial states: state_nominal[0] followed by init_num - 1 Gaussian samples around it
+	if (!initfilename[0]) {
+		RandStream stream;
+		randStreamInit(&stream, seed, 0xFFFFFFFF);
+		mju_copy(init_state, state_nominal[0], statedim);
+		for (int state = 1; state < init_num; state++) {
+			mjtNum *x = init_state + (size_t)state * statedim;
+			randGaussFill(&stream, x, statedim, 0, init_spread * init_spread);
+			mju_addTo(x, state_nominal[0], statedim);
+		}
 	}
-	else printf("Could not open file: init.txt\n");
 
     // install timer callback for profiling if requested
     tm_start = chrono::system_clock::now();
@@ -354,39 +2021,71 @@ int main(int argc, const char** argv)
 
     // print start
     if( nthread>1 )
-        printf("\nRunning %d iterations per thread at dt_c = %g, dt_s = %g, %d steps per rollout, %d rollouts per iteration\n\n", niteration, control_timestep, m->opt.timestep, stepnum, rolloutnum_train);
+        printf("\nRunning %d iterations at dt_c = %g, dt_s = %g, %d steps per rollout, %d rollouts per iteration on %d threads\n\n", niteration, control_timestep, m->opt.timestep, stepnum, rolloutnum_train, nthread);
     else
         printf("\nRunning %d iterations at dt_c = %g, dt_s = %g, %d steps per rollout, %d rollouts per iteration\n\n", niteration, control_timestep, m->opt.timestep, stepnum, rolloutnum_train);
+    if (antithetic)
+        printf("Antithetic perturbations: %d pairs\n", ptbnum);
+    if (qmc)
+        printf("Scrambled Sobol perturbations in %d chunks\n", sobolChunkNum(ptbdim));
+    if (engine)
+        printf("%s engine\n", search_engine[engine].name);
+    else if (update_rule || lr_schedule) {
+        const char* rulename[4] = { "SGD", "Nesterov", "RMSProp", "Adam" };
+        const char* schedulename[4] = { "constant", "step", "exponential", "cosine" };
+        printf("%s update, %s learning rate\n", rulename[update_rule], schedulename[lr_schedule]);
+    }
+    if (line_search)
+        printf("Line search over %d step sizes\n", line_search);
+    if (reuse)
+        printf("Rollout reuse: last %d batches, %d fresh perturbations if the effective sample size is at least %g\n", reuse, reuse_fresh, reuse_ess * ptbnum);
+    if (windownum)
+        printf("Windowed perturbation: %d windows of %d steps, tail %d\n", windownum, window_len, window_tail);
+    if (mpc_horizon)
+        printf("MPC: %d iterations over %d steps every step, budget %g ms\n", niteration, mpc_horizon, mpc_budget);
+    if (sweepfilename[0])
+        printf("Sweep over %d configurations (%s)\n", sweepnum, sweep_random ? "random" : "grid");
+    if (confignum)
+        printf("%d extra cost configurations scored on the nominal rollouts\n", confignum);
+    if (init_num > 1)
+        printf("%d initial states%s%s\n", init_num, initfilename[0] ? " from " : "", initfilename);
+    if (fidelity_levels > 1)
+        printf("Multi-fidelity: %d levels, factor %d, up to %d iterations per coarse level\n", fidelity_levels, fidelity_factor, fidelity_iter);
+    if (basis)
+        printf("%s basis: %d functions per actuator, %d parameters\n", basis == 1 ? "B-spline" : "DCT", basisnum, ptbdim);
+    printf("Random seed: %llu\n\n", (unsigned long long)seed);
 	
-    // run simulation, record total time
+    // start the rollout workers, run training, record total time
     thread th[kMaxThread];
-    double starttime = gettm();
 	for (int id = 0; id < nthread; id++)
-		th[id] = thread(train, id, niteration);
+		th[id] = thread(worker, id);
+    double starttime = gettm();
+	if (sweepfilename[0]) runSweep(niteration);
+	else if (mpc_horizon) runMPC(niteration);
+	else train(0, niteration);
+    double tottime = gettm() - starttime;
+	{
+		std::lock_guard<std::mutex> lock(pool_mtx);
+		pool_exit = true;
+	}
+	pool_start.notify_all();
 	for (int id = 0; id < nthread; id++)
 		th[id].join();
-    double tottime = gettm() - starttime;
 
-    // all-thread summary
-    if( nthread>1 )
-    {
-        printf("Summary for all %d threads\n\n", nthread);
-        printf(" Total simulation time  : %.2f s\n", tottime);
-        printf(" Total steps per second : %.0f\n", nthread*niteration*rolloutnum_train*stepnum*integration_per_step /tottime);
-        printf(" Total realtime factor  : %.2f x\n", nthread*niteration*rolloutnum_train*stepnum*integration_per_step*m->opt.timestep/tottime);
-        printf(" Total time per step    : %.4f ms\n\n", 1000*tottime/(nthread*niteration*rolloutnum_train*stepnum*integration_per_step));
-        printf("Details for thread 0\n\n");
-    }
-
-    // details for thread 0
-    printf("\n Simulation time      : %.2f s\n", simtime[0]);
-	printf(" Number of steps      : %d\n", niteration*rolloutnum_train*stepnum*integration_per_step);
-	printf(" Steps per second     : %.0f\n", niteration*rolloutnum_train*stepnum*integration_per_step / simtime[0]);
-	printf(" Realtime factor      : %.2f x\n", niteration*rolloutnum_train*stepnum*integration_per_step*m->opt.timestep / simtime[0]);
-	printf(" Time per step        : %.4f ms\n\n", 1000 * simtime[0] / (niteration*rolloutnum_train*stepnum*integration_per_step));
+    // summary, the nominal and line search rollouts are included in the step count
+	double nstep = rollout_total*stepnum*integration_per_step;
+    printf("\n Simulation time      : %.2f s\n", tottime);
+	printf(" Number of steps      : %.0f\n", nstep);
+	printf(" Steps per second     : %.0f\n", nstep / tottime);
+	printf(" Realtime factor      : %.2f x\n", nstep*m->opt.timestep / tottime);
+	printf(" Time per step        : %.4f ms\n\n", 1000 * tottime / nstep);
+	if (nthread > 1)
+		printf(" Steps per second per thread : %.0f\n\n", nstep / tottime / nthread);
 	//printf(" Contacts per step    : %d\n", contacts[0] / (niteration*rolloutnum_train*stepnum*integration_per_step));
 	//printf(" Constraints per step : %d\n", constraints[0] / (niteration*rolloutnum_train*stepnum*integration_per_step));
     printf(" Degrees of freedom   : %d\n\n", m->nv);
+	if (reuse)
+		printf(" Reusing batches      : %d, %.0f rollouts saved\n\n", reuse_batches, reuse_saved);
 	
     // profiler results for thread 0
     if( profile )
@@ -403,14 +2102,13 @@ int main(int argc, const char** argv)
     }
 
 	// save result and parameters to file
-	for (int id = 0; id < nthread; id++)
 	{
-		snprintf(datafilename, sizeof(datafilename), "%s%d%s", "result", id, ".txt");
+		strcpy(datafilename, "result0.txt");
 		if ((filestream3 = fopen(datafilename, "wt+")) != NULL)
 		{
 			for (int h = 0; h < stepnum * actuatornum; h++)
 			{
-				sprintf(str2, "%4.8f", ctrl_current[id][h]);
+				sprintf(str2, "%4.8f", ctrl_current[h]);
 				fwrite(str2, 10, 1, filestream3);
 				fputs(" ", filestream3);
 			}
@@ -454,6 +2152,20 @@ int main(int argc, const char** argv)
 			fputs("\nrollout_train: ", filestream3);
 			sprintf(str2, "%4d", rolloutnum_train);
 			fwrite(str2, 3, 1, filestream3);
+			fprintf(filestream3, "\nseed: %llu", (unsigned long long)seed);
+			fprintf(filestream3, "\nantithetic: %d", antithetic);
+			fprintf(filestream3, "\nqmc: %d", qmc);
+			fprintf(filestream3, "\nbasis: %d %d", basis, basisnum);
+			fprintf(filestream3, "\nupdate: %d lr_schedule: %d", update_rule, lr_schedule);
+			fprintf(filestream3, "\nline_search: %d", line_search);
+			fprintf(filestream3, "\nreuse: %d %d %g", reuse, reuse_fresh, reuse_ess);
+			fprintf(filestream3, "\noptimizer: %d", engine);
+			fprintf(filestream3, "\nwindow: %d %d", windownum, window_tail);
+			fprintf(filestream3, "\nfidelity: %d %d %d", fidelity_levels, fidelity_factor, fidelity_iter);
+			fprintf(filestream3, "\ninit: %d %g", init_num, init_spread);
+			fprintf(filestream3, "\nmpc: %d %g", mpc_horizon, mpc_budget);
+			for (int k = 0; k < confignum; k++)
+				fprintf(filestream3, "\ncost_config %d: %g %g %g %.4f", k, cost_config[k].Q, cost_config[k].QT, cost_config[k].R, config_cost[k]);
 			fclose(filestream3);
 		}
 	}
@@ -461,6 +2173,41 @@ int main(int argc, const char** argv)
     // free per-thread data
     for( int id=0; id<nthread; id++ )
         mj_deleteData(d[id]);
+    alignedFree(ctrl_current);
+    alignedFree(ctrl_init);
+    alignedFree(gradient);
+    alignedFree(ctrl_step);
+    alignedFree(ctrl_best);
+    delete[] delta_u;
+    delete[] rollout_cost;
+    delete[] rollout_weight;
+    delete[] init_state;
+    delete[] state_cost;
+    delete[] state_config_cost;
+    delete[] config_matrix;
+    delete[] update_m;
+    delete[] update_v;
+    delete[] line_delta;
+    delete[] line_cost;
+    delete[] reuse_ctrl;
+    delete[] reuse_ptb;
+    delete[] reuse_cost;
+    delete[] reuse_weight;
+    delete[] search_std;
+    delete[] cma_c;
+    delete[] cma_ps;
+    delete[] cma_pc;
+    delete[] search_mean;
+    delete[] search_var;
+    delete[] member_order;
+    for (int window = 0; window < windownum; window++)
+        mj_deleteData(window_data[window]);
+    delete[] nominal_stage;
+    delete[] qmc_order;
+    delete[] basis_matrix;
+    if (basis)
+        for (int id = 0; id < nthread; id++)
+            delete[] ptb_step[id];
 
     // finalize
 	return finish(0, m);
@@ -0,0 +1,196 @@
+/*  Copyright  2018, Roboti LLC
+
+    This file is licensed under the MuJoCo Resource License (the "License").
+    You may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        https://www.roboti.us/resourcelicense.txt
+*/
+
+#include <windows.h>
+#include "funclib.h"
+
+//-------------------------------- global variables -------------------------------------
+// constants
+extern const int kMaxState = 160;	// max (state dimension, actuator number)
+
+// extern model specific parameters
+extern int integration_per_step;
+extern int stepnum;
+extern int actuatornum;
+extern int quatnum;
+extern int dof;
+extern mjtNum control_timestep;
+extern mjtNum simulation_timestep;
+extern AlignedMatrix state_nominal;
+
+// model and data
+mjModel* m = NULL;
+mjData* d = NULL;
+mjtNum* ctrl = NULL;                // stepnum x actuatornum
+char keyfilename[100];
+char modelfilename[100];
+char username[30];
+char modelname[30];
+char keyfilepre[20] = "";
+
+
+// timer
+chrono::system_clock::time_point tm_start;
+mjtNum gettm(void)
+{
+    chrono::duration<double> elapsed = chrono::system_clock::now() - tm_start;
+    return elapsed.count();
+}
+
+
+// deallocate and print message
+int finish(const char* msg = NULL, mjModel* m = NULL, mjData* d = NULL)
+{
+    // deallocate model and data
+    if( d )
+        mj_deleteData(d);
+    if( m )
+        mj_deleteModel(m);
+    mj_deactivate();
+
+    // print message
+    if( msg )
+        printf("%s\n", msg);
+
+    return 0;
+}
+
+// rollout as before the step pipeline: integration_per_step mj_step calls and a full mj_forward for the cost
+mjtNum rolloutForward(void)
+{
+	mjtNum cost = 0;
+
+	modelInit(m, d, state_nominal[0]);
+	for (int step_index = 0; step_index < stepnum; step_index++) {
+		mju_copy(d->ctrl, ctrl + step_index * actuatornum, actuatornum);
+		cost += stepCost(m, d, step_index);
+		for (int i = 0; i < integration_per_step; i++) mj_step(m, d);
+		mj_forward(m, d);
+	}
+	return cost + stepCost(m, d, stepnum);
+}
+
+// rollout with the mj_step1/mj_step2 pipeline of controlStep
+mjtNum rolloutPipeline(void)
+{
+	mjtNum cost = 0;
+
+	modelInit(m, d, state_nominal[0]);
+	for (int step_index = 0; step_index < stepnum; step_index++) {
+		mju_copy(d->ctrl, ctrl + step_index * actuatornum, actuatornum);
+		cost += stepCost(m, d, step_index);
+		controlStep(m, d);
+	}
+	return cost + stepCost(m, d, stepnum);
+}
+
+
+// main function
+int main(int argc, const char** argv)
+{
+    // print help if arguments are missing
+    if( argc<4 || argc>6 )
+        return finish("\n Usage: stepbench modelfile control_timestep stepnum [nrollout [model]]\n");
+
+    // activate MuJoCo Pro license (this must be *your* activation key)
+	DWORD usernamesize = 30;
+	GetUserName(username, &usernamesize);
+	if (username[0] == 'R') {
+		strcpy(keyfilename, keyfilepre);
+		strcat(keyfilename, "mjkeybig.txt");
+		mj_activate(keyfilename);
+	}
+	else if (username[0] == 'r') {
+		strcpy(keyfilename, keyfilepre);
+		strcat(keyfilename, "mjkeyda.txt");
+		mj_activate(keyfilename);
+	}
+	else {
+		strcpy(keyfilename, keyfilepre);
+		strcat(keyfilename, "mjkeysmall.txt");
+		mj_activate(keyfilename);
+	}
+
+	// get filename, determine file type
+	std::string filename(argv[1]);
+	bool binary = (filename.find(".mjb") != std::string::npos);
+	strcpy(modelfilename, argv[1]);
+	strncpy(modelname, modelfilename, strlen(modelfilename) - 4);
+	modelSelection(modelname);
+	if (argc > 5 && modelSelection(argv[5]) != 1)
+		return finish("Unknown model");
+
+	// read control_timestep, stepnum and nrollout
+	int nrollout = 20;
+	if (sscanf(argv[2], "%lf", &control_timestep) != 1 || control_timestep <= 0)
+		return finish("Invalid control_timestep argument");
+	if (sscanf(argv[3], "%d", &stepnum) != 1 || stepnum <= 0)
+		return finish("Invalid stepnum argument");
+	if (argc > 4 && (sscanf(argv[4], "%d", &nrollout) != 1 || nrollout <= 0))
+		return finish("Invalid nrollout argument");
+
+	// load model
+	char error[500] = "Could not load binary model";
+	if( binary )
+		m = mj_loadModel(modelfilename, 0);
+	else
+		m = mj_loadXML(modelfilename, 0, error, 500);
+	if( !m )
+		return finish(error);
+	if (modelDimension(m) != 1)
+		return finish("Unknown model or model dimension over kMaxState", m);
+
+	// check timestep setting
+	simulation_timestep = m->opt.timestep;
+	integration_per_step = (int)(control_timestep / simulation_timestep);
+	if (integration_per_step <= 0)
+		return finish("Invalid timestep setting", m);
+
+	d = mj_makeData(m);
+	ctrl = alignedAlloc((size_t)stepnum * actuatornum);
+	if( !d || !ctrl )
+		return finish("Could not allocate mjData", m, d);
+
+	// controls of the last training if present, zero otherwise, held over a shorter horizon
+	mjtNum dt = 0;
+	int nstep = 0;
+	int num = readResult("result0.txt", ctrl, stepnum * actuatornum, &dt, &nstep);
+	if (num >= actuatornum && actuatornum > 0) {
+		for (int i = num; i < stepnum * actuatornum; i++) ctrl[i] = ctrl[i - actuatornum];
+		printf("\n Controls from result0.txt, %d steps\n", num / actuatornum);
+	}
+	else printf("\n Zero controls, result0.txt not found\n");
+
+	// time both loops, warm up once and alternate so both see the same cache and clock state
+	mjtNum cost_forward = rolloutForward(), cost_pipeline = rolloutPipeline();
+	mjtNum time_forward = 0, time_pipeline = 0, diff = mju_abs(cost_forward - cost_pipeline);
+	tm_start = chrono::system_clock::now();
+	for (int k = 0; k < nrollout; k++) {
+		mjtNum start = gettm();
+		rolloutForward();
+		time_forward += gettm() - start;
+		start = gettm();
+		rolloutPipeline();
+		time_pipeline += gettm() - start;
+	}
+
+	// steps per second counts physics steps, integration_per_step per control step
+	mjtNum nphysics = (mjtNum)nrollout * stepnum * integration_per_step;
+	printf(" Model                : %s\n", modelname);
+	printf(" Integrator           : %s\n", m->opt.integrator == mjINT_EULER ? "Euler" : "RK4");
+	printf(" Control steps        : %d x %d physics steps\n", stepnum, integration_per_step);
+	printf(" Rollouts             : %d\n", nrollout);
+	printf(" mj_step + mj_forward : %.0f steps/s, %.3f s\n", nphysics / time_forward, time_forward);
+	printf(" mj_step1/mj_step2    : %.0f steps/s, %.3f s\n", nphysics / time_pipeline, time_pipeline);
+	printf(" Speedup              : %.2fx\n", time_forward / time_pipeline);
+	printf(" Cost                 : %.6e, difference %.3e\n", cost_pipeline, diff);
+
+	alignedFree(ctrl);
+	return finish(NULL, m, d);
+}
@@ -13,7 +13,6 @@
 
 //-------------------------------- global variables -------------------------------------
 // constants
-extern const int kMaxStep = 3000;   // max step number for one rollout
 extern const int kMaxState = 160;	// max (state dimension, actuator number)
 const int kTestNum = 100;	        // number of monte-carlo runs
 const int kMaxThread = 8;           // max thread number
@@ -24,21 +23,23 @@ extern int stepnum;
 extern int actuatornum;
 extern int quatnum;
 extern int dof;		   
+extern int statedim;
 extern int modelid;
 extern mjtNum control_timestep;
 extern mjtNum simulation_timestep;
-extern mjtNum state_nominal[kMaxStep][kMaxState];
-extern mjtNum state_target[kMaxState];
-extern mjtNum ctrl_nominal[kMaxStep * kMaxState];
+extern AlignedMatrix state_nominal;
+extern mjtNum* state_target;
+extern mjtNum* ctrl_nominal;
 
 // user data and other training settings
-mjtNum matAB_check[kMaxStep][kMaxState][kMaxState + kMaxState] = { 0 };
-mjtNum dx_estimate[kMaxStep][kMaxState] = { 0 };
-mjtNum dx_input[kMaxStep][kMaxState + kMaxState] = { 0 };
-mjtNum dx_simulate[kMaxStep][kMaxState] = { 0 };											
+AlignedMatrix matAB_check;          // stepnum blocks of statedim x (statedim + actuatornum)
+AlignedMatrix dx_estimate;          // stepnum x state width
+AlignedMatrix dx_input;             // stepnum x (state width + actuatornum)
+AlignedMatrix dx_simulate;          // stepnum x state width
 mjtNum ctrl_max = 0;
 mjtNum sysiderr = 0;
 mjtNum perturb_coefficient_sysid;
+uint64_t seed = 0;                  // the perturbations only depend on (seed, step, rollout)
 FILE *filestream3;
 char data_buff[30], idstr[10];
 char keyfilename[100];
@@ -94,7 +95,7 @@ void sysidCheck(mjModel* m, mjData* d)
 			for (int m = 0; m < stepnum; m++) dx_input[m][i] = 0.001 * ctrl_max * randGauss(0, 1);
 		}
 		// result from the identified system
-		for (int j = 0; j < stepnum; j++) mju_mulMatVec(dx_estimate[j], *matAB_check[j], dx_input[j], kMaxState, kMaxState + kMaxState);
+		for (int j = 0; j < stepnum; j++) mju_mulMatVec(dx_estimate[j], matAB_check[j * statedim], dx_input[j], statedim, statedim + actuatornum);
 
 		// result from the real system
 		for (int step_index = 0; step_index < stepnum; step_index++)
@@ -173,8 +174,6 @@ void sysidCheck(mjModel* m, mjData* d)
 
 				for (int y = 0; y < actuatornum; y++) d->ctrl[y] = ctrl_nominal[step_index * actuatornum + y];
 			}
-			mj_forward(m, d);
-
 			for (int k = 0; k < integration_per_step; k++) mj_step(m, d);
 
 			mju_sub(dx_simulate[step_index], d->qpos, state_nominal[step_index + 1], dof + quatnum);
@@ -206,20 +205,24 @@ void sysid(int id, int nroll, int nthd)
 	MatrixXd delta_x1(nroll, 2*dof + quatnum + actuatornum);
 	MatrixXd delta_x2(2*dof + quatnum, nroll);
 	MatrixXd matAB(2*dof + quatnum, 2*dof + quatnum + actuatornum);				 
+	mjtNum noise[kMaxState + kMaxState];
+	RandStream stream;
 	mjtNum printfraction = 0.2;
 
 	// clear statistics
 	contacts[id] = 0;
 	constraints[id] = 0;
-	srand((unsigned)time(NULL) + id);
 
 	// run and time
 	double start = gettm();
-	for (int step_index = id*int(stepnum/nthd); step_index < (id+1)*int(stepnum / nthd); step_index++)
+	// contiguous block of steps, the blocks cover every step for any thread number
+	for (int step_index = id*stepnum/nthd; step_index < (id+1)*stepnum/nthd; step_index++)
 	{
 		for (int rollout_index = 0; rollout_index < nroll; rollout_index++)
 		{
-			for (int y = 0; y < 2*dof + quatnum + actuatornum; y++) delta_x1(rollout_index, y) = perturb_coefficient_sysid * ctrl_max * randGauss(0, 1);
+			randStreamInit(&stream, seed, step_index, rollout_index);
+			randGaussFill(&stream, noise, 2*dof + quatnum + actuatornum);
+			for (int y = 0; y < 2*dof + quatnum + actuatornum; y++) delta_x1(rollout_index, y) = perturb_coefficient_sysid * ctrl_max * noise[y];
 
 			// plus
 			for (int y = 0; y < dof + quatnum; y++) d[id]->qpos[y] = state_nominal[step_index][y] + delta_x1(rollout_index, y);
@@ -296,7 +299,6 @@ void sysid(int id, int nroll, int nthd)
 
 				for (int y = 0; y < actuatornum; y++) d[id]->ctrl[y] = ctrl_nominal[step_index * actuatornum + y];
 			}
-			mj_forward(m, d[id]);
 			for (int i = 0; i < integration_per_step; i++) mj_step(m, d[id]);
 
 			for (int y = 0; y < dof + quatnum; y++) delta_x2(y, rollout_index) = d[id]->qpos[y];
@@ -385,7 +387,6 @@ void sysid(int id, int nroll, int nthd)
 
 				for (int y = 0; y < actuatornum; y++) d[id]->ctrl[y] = ctrl_nominal[step_index * actuatornum + y];
 			}
-			mj_forward(m, d[id]);
 			for (int i = 0; i < integration_per_step; i++) mj_step(m, d[id]);
 
 			for (int y = 0; y < dof + quatnum; y++) delta_x2(y, rollout_index) -= d[id]->qpos[y];
@@ -406,7 +407,7 @@ void sysid(int id, int nroll, int nthd)
 			matAB.block(0, 0, 2 * dof + quatnum, 2 * dof + quatnum) = (delta_x2*delta_x1.block(0, 0, nroll, 2 * dof + quatnum)*((delta_x1.block(0, 0, nroll, 2 * dof + quatnum).transpose()*delta_x1.block(0, 0, nroll, 2 * dof + quatnum)).inverse())) / 2;
 		}
 
-		for (int h = 0; h < 2*dof + quatnum; h++) for (int d = 0; d < 2*dof + quatnum + actuatornum; d++) matAB_check[step_index][h][d] = matAB(h, d);
+		for (int h = 0; h < 2*dof + quatnum; h++) for (int d = 0; d < 2*dof + quatnum + actuatornum; d++) matAB_check[step_index * statedim + h][d] = matAB(h, d);
 
 		// print '.' every printfraction of nrollout for thread 0
 		if (id == 0 && step_index >= stepnum / nthd * printfraction)
@@ -448,6 +449,16 @@ int main(int argc, const char** argv)
 	strcpy(modelfilename, argv[1]);
 	strncpy(modelname, modelfilename, strlen(modelfilename) - 4);
 	modelSelection(modelname);
+	seed = (uint64_t)time(NULL);
+	strcpy(datafilename, "parameters.txt");
+	if ((filestream3 = fopen(datafilename, "r")) != NULL) {
+		// the seed of openloop also fixes the perturbations, lnr.txt is then identical for any thread number
+		while (fscanf(filestream3, "%s", data_buff) == 1)
+			if (strcmp(data_buff, "seed:") == 0 && fscanf(filestream3, "%s", data_buff) == 1)
+				seed = strtoull(data_buff, NULL, 10);
+		fclose(filestream3);
+	}
+	randSeed(seed);
 
 	// set timestep and stepnum
 	if (sscanf(argv[2], "%lf", &control_timestep) != 1 || control_timestep <= 0) 
@@ -488,6 +499,24 @@ int main(int argc, const char** argv)
     // clamp nthread to [1, kMaxThread]
     nthread = mjMAX(1, mjMIN(kMaxThread, nthread));
 
+    // load model
+    char error[500] = "Could not load binary model";
+    if( binary )
+        m = mj_loadModel(modelfilename, 0);
+    else
+        m = mj_loadXML(modelfilename, 0, error, 500);
+    if( !m )
+        return finish(error);
+	if (modelDimension(m) != 1)
+		return finish("Unknown model or model dimension over kMaxState", m);
+	int width = state_nominal.cols;
+	matrixResize(&matAB_check, stepnum * statedim, statedim + actuatornum);
+	matrixResize(&dx_estimate, stepnum, width);
+	matrixResize(&dx_input, stepnum, width + actuatornum);
+	matrixResize(&dx_simulate, stepnum, width);
+	if (!matAB_check.data || !dx_estimate.data || !dx_input.data || !dx_simulate.data)
+		return finish("Could not allocate the identification storage", m);
+
 	// read nominal control values
 	strcpy(datafilename, "result0.txt");
 	if ((filestream3 = fopen(datafilename, "r")) != NULL) {
@@ -503,21 +532,12 @@ int main(int argc, const char** argv)
 
 	if (_strcmpi(sysmode, "top") == 0) {
 		nthread = 1;
+		mju_zero(ctrl_nominal, (stepnum + 1) * actuatornum);
 		stepnum = 1;
 		strcpy(resultfilename, "lnr_top.txt");
 		mju_copy(state_nominal[0], state_target, 2 * dof + quatnum);
-		mju_zero(ctrl_nominal, kMaxStep * kMaxState);
 	}
 
-    // load model
-    char error[500] = "Could not load binary model";
-    if( binary )
-        m = mj_loadModel(modelfilename, 0);
-    else
-        m = mj_loadXML(modelfilename, 0, error, 500);
-    if( !m )
-        return finish(error);
-
 	// check timestep setting
 	simulation_timestep = m->opt.timestep;
 	integration_per_step = (int)(control_timestep / simulation_timestep);
@@ -610,7 +630,7 @@ int main(int argc, const char** argv)
 			{
 				for (int d = 0; d < 2*dof + quatnum + actuatornum; d++)
 				{
-					sprintf(data_buff, "%4.12f", matAB_check[i][h][d]);
+					sprintf(data_buff, "%4.12f", matAB_check[i * statedim + h][d]);
 					fwrite(data_buff, 14, 1, filestream3);
 					fputs(" ", filestream3);
 				}
@@ -14,8 +14,6 @@
 //-------------------------------- global variables -------------------------------------
 // constants
 extern const int kTestNum = 100;	// number of monte-carlo runs
-extern const int kMaxStep = 500;   // max step number for one rollout
-extern const int kMaxState = 20;	// max state dimension
 const int kMaxThread = 2;
 
 // extern model specific parameters
@@ -27,14 +25,18 @@ extern int modelid;
 extern mjtNum control_timestep;
 extern mjtNum simulation_timestep;
 extern mjtNum perturb_coefficient_sysid;
-extern mjtNum state_nominal[kMaxStep][kMaxState];
-extern mjtNum ctrl_nominal[kMaxStep * kMaxState];
+extern AlignedMatrix state_nominal;
+extern mjtNum* ctrl_nominal;
 extern char testmode[30];
 
 // user data and other training settings
-mjtNum matAB[kMaxThread][kMaxStep][kMaxState][kMaxState + kMaxState] = { 0 };
+AlignedMatrix matAB[kMaxThread];    // per thread, stepnum blocks of statenum x (statenum + actuatornum)
+AlignedMatrix dx_estimate;          // stepnum x statenum
+AlignedMatrix dx_input;             // stepnum x (statenum + actuatornum)
+AlignedMatrix dx_simulate;          // stepnum x statenum
 mjtNum ctrl_max = 0;
 mjtNum sysiderr = 0;
+uint64_t seed = 0;                  // the perturbations only depend on (seed, step, rollout)
 FILE *filestream2, *filestream3;
 static int iteration_index[kMaxThread] = { 0 };
 char data_buff[30], idstr[10];
@@ -82,17 +84,13 @@ int finish(const char* msg = NULL, mjModel* m = NULL)
 
 void sysidCheck(mjModel* m, mjData* d)
 {
-	mjtNum dx_estimate[kMaxStep][kMaxState];
-	mjtNum dx_input[kMaxStep][kMaxState + kMaxState] = { 0 };
-	mjtNum dx_simulate[kMaxStep][kMaxState] = { 0 };
-
 	for (int t = 0; t < kTestNum; t++)
 	{
 		for (int i = 0; i < statenum + actuatornum; i++)
 		{
 			for (int m = 0; m < stepnum; m++) dx_input[m][i] = 0.01 * ctrl_max * randGauss(0, 1);
 		}
-		for (int j = 0; j < stepnum; j++) mju_mulMatVec(dx_estimate[j], *matAB[0][j], dx_input[j], kMaxState, kMaxState+ kMaxState);
+		for (int j = 0; j < stepnum; j++) mju_mulMatVec(dx_estimate[j], matAB[0][j * statenum], dx_input[j], statenum, statenum + actuatornum);
 		for (int step_index = 0; step_index < stepnum; step_index++)
 		{
 			mju_add(d->qpos, dx_input[step_index], state_nominal[step_index], int(statenum/2));
@@ -125,15 +123,15 @@ void sysidCheck(mjModel* m, mjData* d)
 // thread function
 void sysid(int id, int nite)
 {
-	mjtNum delta_x1[kMaxState + kMaxState] = { 0 };
-	mjtNum delta_x2[kMaxState] = { 0 };
+	mjtNum* delta_x1 = alignedAlloc(statenum + actuatornum);
+	mjtNum* delta_x2 = alignedAlloc(statenum);
+	RandStream stream;
 	char str1[30];
 
 	// clear statistics
 	contacts[id] = 0;
 	constraints[id] = 0;
 	printfraction = 0.1;
-	srand((unsigned)time(NULL));
 
 	// run and time
 	double start = gettm();
@@ -141,7 +139,10 @@ void sysid(int id, int nite)
 	{
 		for (int step_index = 0; step_index < stepnum; step_index++)
 		{
-			for (int y = 0; y < statenum + actuatornum; y++) delta_x1[y] = perturb_coefficient_sysid * ctrl_max * randGauss(0, 1);
+			// rollouts of thread id are numbered after those of the threads before it, so no two threads share a stream
+			randStreamInit(&stream, seed, step_index, id * nite + iteration_index[id]);
+			randGaussFill(&stream, delta_x1, statenum + actuatornum);
+			for (int y = 0; y < statenum + actuatornum; y++) delta_x1[y] *= perturb_coefficient_sysid * ctrl_max;
 
 			mju_add(d[id]->qpos, delta_x1, state_nominal[step_index], int(statenum / 2));
 			mju_add(d[id]->qvel, &delta_x1[int(statenum / 2)], &state_nominal[step_index][int(statenum / 2)], int(statenum / 2));
@@ -164,11 +165,11 @@ void sysid(int id, int nite)
 			{
 				for (int i = 0; i < statenum + actuatornum; i++)
 				{
-					matAB[id][step_index][y][i] = matAB[id][step_index][y][i] * (1 - 1 / (iteration_index[id] + 1.0)) + delta_x2[y] * delta_x1[i] / ((iteration_index[id] + 1.0) * perturb_coefficient_sysid * perturb_coefficient_sysid * ctrl_max * ctrl_max);
+					matAB[id][step_index * statenum + y][i] = matAB[id][step_index * statenum + y][i] * (1 - 1 / (iteration_index[id] + 1.0)) + delta_x2[y] * delta_x1[i] / ((iteration_index[id] + 1.0) * perturb_coefficient_sysid * perturb_coefficient_sysid * ctrl_max * ctrl_max);
 				}
 			}
 		}
-		sprintf(str1, "%3.3f", matAB[id][0][0][1]);
+		sprintf(str1, "%3.3f", matAB[id][0][1]);
 		fwrite(str1, 5, 1, filestream2);
 		fputs(" ", filestream2);
 
@@ -183,6 +184,8 @@ void sysid(int id, int nite)
 		constraints[id] += d[id]->nefc;
 		simtime[id] = gettm() - start;
 	}
+	alignedFree(delta_x1);
+	alignedFree(delta_x2);
 }
 
 // main function
@@ -212,6 +215,16 @@ int main(int argc, const char** argv)
 	strcpy(modelfilename, argv[1]);
 	strncpy(modelname, modelfilename, strlen(modelfilename) - 4);
 	modelSelection(modelname);
+	seed = (uint64_t)time(NULL);
+	strcpy(datafilename, "parameters.txt");
+	if ((filestream3 = fopen(datafilename, "r")) != NULL) {
+		// the seed of openloop also fixes the perturbations of the identification
+		while (fscanf(filestream3, "%s", data_buff) == 1)
+			if (strcmp(data_buff, "seed:") == 0 && fscanf(filestream3, "%s", data_buff) == 1)
+				seed = strtoull(data_buff, NULL, 10);
+		fclose(filestream3);
+	}
+	randSeed(seed);
 
 	// read niteration and nthread
 	int niteration = 0, nthread = 0, profile = 0;
@@ -243,6 +256,18 @@ int main(int argc, const char** argv)
         m = mj_loadXML(modelfilename, 0, error, 500);
     if( !m )
         return finish(error);
+    if (modelDimension(m) != 1)
+        return finish("Unknown model or model dimension over kMaxState", m);
+    for( int id=0; id<nthread; id++ )
+        matrixResize(&matAB[id], stepnum * statenum, statenum + actuatornum);
+    matrixResize(&dx_estimate, stepnum, statenum);
+    matrixResize(&dx_input, stepnum, statenum + actuatornum);
+    matrixResize(&dx_simulate, stepnum, statenum);
+    for( int id=0; id<nthread; id++ )
+        if( !matAB[id].data )
+            return finish("Could not allocate the identification storage", m);
+    if( !dx_estimate.data || !dx_input.data || !dx_simulate.data )
+        return finish("Could not allocate the identification storage", m);
 
     // make per-thread data
     int testkey = mj_name2id(m, mjOBJ_KEY, "test");
@@ -305,7 +330,7 @@ int main(int argc, const char** argv)
 			for (int j = 0; j < actuatornum; j++)
 			{
 				for (int k = 0; k < statenum + actuatornum; k++)
-					matAB[0][i][j][k] += matAB[idt][i][j][k];
+					matAB[0][i * statenum + j][k] += matAB[idt][i * statenum + j][k];
 			}
 		}
 	}
@@ -314,7 +339,7 @@ int main(int argc, const char** argv)
 		for (int j = 0; j < actuatornum; j++)
 		{
 			for (int k = 0; k < statenum + actuatornum; k++)
-				matAB[0][i][j][k] = matAB[0][i][j][k]/(nthread+1);
+				matAB[0][i * statenum + j][k] = matAB[0][i * statenum + j][k]/(nthread+1);
 		}
 	}*/
     double tottime = gettm() - starttime;
@@ -364,7 +389,7 @@ int main(int argc, const char** argv)
 			{
 				for (int d = 0; d < statenum + actuatornum; d++)
 				{
-					sprintf(data_buff, "%4.8f", matAB[0][t][h][d]);
+					sprintf(data_buff, "%4.8f", matAB[0][t * statenum + h][d]);
 					fwrite(data_buff, 10, 1, filestream3);
 					fputs(" ", filestream3);
 				}
@@ -13,7 +13,6 @@
 
 //-------------------------------- global variables -------------------------------------
 // constants
-extern const int kMaxStep = 3000;   // max step number for one rollout
 extern const int kMaxState = 160;	// max (state dimension, actuator number)
 const int kTestNum = 100;	        // number of monte-carlo runs
 const int kMaxThread = 8;           // max thread number
@@ -24,21 +23,23 @@ extern int stepnum;
 extern int actuatornum;
 extern int quatnum;
 extern int dof;
+extern int statedim;
 extern int modelid;
 extern mjtNum control_timestep;
 extern mjtNum simulation_timestep;
-extern mjtNum state_nominal[kMaxStep][kMaxState];
-extern mjtNum ctrl_nominal[kMaxStep * kMaxState];
+extern AlignedMatrix state_nominal;
+extern mjtNum* ctrl_nominal;
 extern char testmode[30];
 
 // user data and other training settings
-mjtNum matAB_check[kMaxStep][kMaxState][kMaxState + kMaxState] = { 0 };
-mjtNum dx_estimate[kMaxStep][kMaxState] = { 0 };
-mjtNum dx_input[kMaxStep][kMaxState + kMaxState] = { 0 };
-mjtNum dx_simulate[kMaxStep][kMaxState] = { 0 };
+AlignedMatrix matAB_check;          // stepnum blocks of statedim x (statedim + actuatornum)
+AlignedMatrix dx_estimate;          // stepnum x state width
+AlignedMatrix dx_input;             // stepnum x (state width + actuatornum)
+AlignedMatrix dx_simulate;          // stepnum x state width
 mjtNum ctrl_max = 0;
 mjtNum sysiderr = 0;
 mjtNum perturb_coefficient_sysid;
+uint64_t seed = 0;                  // the perturbations only depend on (seed, step, rollout)
 FILE *filestream3;
 char data_buff[30], idstr[10];
 char keyfilename[100];
@@ -185,7 +186,7 @@ void sysidCheck(mjModel* m, mjData* d)
 
 		for (int j = 0; j < stepnum; j++) {
 			//dx_input[j][5] = 0;
-			mju_mulMatVec(dx_estimate[j], *matAB_check[j], dx_input[j], kMaxState, kMaxState + kMaxState);
+			mju_mulMatVec(dx_estimate[j], matAB_check[j * statedim], dx_input[j], statedim, statedim + actuatornum);
 		}
 
 		for (int y = 0; y < 2*dof + quatnum; y++)
@@ -206,36 +207,41 @@ void sysid(int id, int nroll, int nthd)
 	MatrixXd delta_x2(2 * dof + quatnum, nroll);
 	MatrixXd matAB(2 * dof + quatnum, 2 * dof + quatnum + actuatornum);
 	mjtNum temp0[4] = { 0 };
+	mjtNum noise[3 * kMaxState];
+	RandStream stream;
 	mjtNum printfraction = 0.2;
 
 	// clear statistics
 	contacts[id] = 0;
 	constraints[id] = 0;
-	srand((unsigned)time(NULL) + id);
 
 	// run and time
 	double start = gettm();
-	for (int step_index = id*int(stepnum/nthd); step_index < (id+1)*int(stepnum / nthd); step_index++)
+	// contiguous block of steps, the blocks cover every step for any thread number
+	for (int step_index = id*stepnum/nthd; step_index < (id+1)*stepnum/nthd; step_index++)
 	{
 		for (int rollout_index = 0; rollout_index < nroll; rollout_index++)
 		{
-			for (int y = 0; y < 2 * dof + quatnum + actuatornum; y++) delta_x1(rollout_index, y) = perturb_coefficient_sysid * ctrl_max * randGauss(0, 1);
+			int nnoise = 2 * dof + quatnum + actuatornum;
+			randStreamInit(&stream, seed, step_index, rollout_index);
+			randGaussFill(&stream, noise, nnoise + 4 * mjMAX(quatnum, 1));
+			for (int y = 0; y < nnoise; y++) delta_x1(rollout_index, y) = perturb_coefficient_sysid * ctrl_max * noise[y];
 
 			// special process for quaternions
 			if (modelid == 10) {
-				for (int y = 0; y < 4; y++) temp0[y] = ctrl_max * perturb_coefficient_sysid * randGauss(0, 1) + state_nominal[step_index][y + 3];
+				for (int y = 0; y < 4; y++) temp0[y] = ctrl_max * perturb_coefficient_sysid * noise[nnoise + y] + state_nominal[step_index][y + 3];
 				mju_normalize4(temp0);
 				for (int y = 0; y < 4; y++) delta_x1(rollout_index, y + 3) = temp0[y] - state_nominal[step_index][y + 3];
 			}
 			else if (modelid == 11) {
 				for (int q = 0; q < quatnum; q++) {
-					for (int y = 0; y < 4; y++) temp0[y] = perturb_coefficient_sysid * ctrl_max * randGauss(0, 1) + state_nominal[step_index][y + 4 * q];
+					for (int y = 0; y < 4; y++) temp0[y] = perturb_coefficient_sysid * ctrl_max * noise[nnoise + 4 * q + y] + state_nominal[step_index][y + 4 * q];
 					mju_normalize4(temp0);
 					for (int y = 0; y < 4; y++) delta_x1(rollout_index, y + 4 * q) = temp0[y] - state_nominal[step_index][y + 4 * q];
 				}
 			}
 			else if (modelid == 12) {
-				for (int y = 0; y < 4; y++) temp0[y] = ctrl_max * perturb_coefficient_sysid * randGauss(0, 1) + state_nominal[step_index][y];
+				for (int y = 0; y < 4; y++) temp0[y] = ctrl_max * perturb_coefficient_sysid * noise[nnoise + y] + state_nominal[step_index][y];
 				mju_normalize4(temp0);
 				for (int y = 0; y < 4; y++) delta_x1(rollout_index, y) = temp0[y] - state_nominal[step_index][y];
 			}
@@ -338,7 +344,7 @@ void sysid(int id, int nroll, int nthd)
 			//for (int y = 0; y < dof; y++) delta_x2(y + dof + quatnum, rollout_index) -= d[id]->qvel[y];
 		}
 		matAB = (delta_x2*delta_x1*((delta_x1.transpose()*delta_x1).inverse())) / 1;
-		for (int h = 0; h < 2*dof + quatnum; h++) for (int d = 0; d < 2*dof + quatnum + actuatornum; d++) matAB_check[step_index][h][d] = matAB(h, d);
+		for (int h = 0; h < 2*dof + quatnum; h++) for (int d = 0; d < 2*dof + quatnum + actuatornum; d++) matAB_check[step_index * statedim + h][d] = matAB(h, d);
 
 		// print '.' every printfraction of nrollout for thread 0
 		if (id == 0 && step_index >= stepnum / nthd * printfraction)
@@ -380,6 +386,16 @@ int main(int argc, const char** argv)
 	strcpy(modelfilename, argv[1]);
 	strncpy(modelname, modelfilename, strlen(modelfilename) - 4);
 	modelSelection(modelname);
+	seed = (uint64_t)time(NULL);
+	strcpy(datafilename, "parameters.txt");
+	if ((filestream3 = fopen(datafilename, "r")) != NULL) {
+		// the seed of openloop also fixes the perturbations, lnr.txt is then identical for any thread number
+		while (fscanf(filestream3, "%s", data_buff) == 1)
+			if (strcmp(data_buff, "seed:") == 0 && fscanf(filestream3, "%s", data_buff) == 1)
+				seed = strtoull(data_buff, NULL, 10);
+		fclose(filestream3);
+	}
+	randSeed(seed);
 
 	// set timestep and stepnum
 	if (sscanf(argv[2], "%lf", &control_timestep) != 1 || control_timestep <= 0)
@@ -419,6 +435,15 @@ int main(int argc, const char** argv)
         m = mj_loadXML(modelfilename, 0, error, 500);
     if( !m )
         return finish(error);
+	if (modelDimension(m) != 1)
+		return finish("Unknown model or model dimension over kMaxState", m);
+	int width = state_nominal.cols;
+	matrixResize(&matAB_check, stepnum * statedim, statedim + actuatornum);
+	matrixResize(&dx_estimate, stepnum, width);
+	matrixResize(&dx_input, stepnum, width + actuatornum);
+	matrixResize(&dx_simulate, stepnum, width);
+	if (!matAB_check.data || !dx_estimate.data || !dx_input.data || !dx_simulate.data)
+		return finish("Could not allocate the identification storage", m);
 
 	// check timestep setting
 	simulation_timestep = m->opt.timestep;
@@ -525,7 +550,7 @@ int main(int argc, const char** argv)
 			{
 				for (int d = 0; d < 2*dof + quatnum + actuatornum; d++)
 				{
-					sprintf(data_buff, "%4.8f", matAB_check[i][h][d]);
+					sprintf(data_buff, "%4.8f", matAB_check[i * statedim + h][d]);
 					fwrite(data_buff, 10, 1, filestream3);
 					fputs(" ", filestream3);
 				}
@@ -15,7 +15,6 @@
 
 //-------------------------------- global -----------------------------------------------
 // constants
-extern const int kMaxStep = 3000;   // max step number for one rollout
 extern const int kMaxState = 160;	// max (state dimension, actuator number)
 
 const int kTestNum = 1000;	        // number of monte-carlo runs
@@ -29,22 +28,23 @@ extern int stepnum;
 extern int actuatornum;
 extern int quatnum;
 extern int dof;
+extern int statedim;
 extern int modelid;
 extern mjtNum control_timestep;
 extern mjtNum simulation_timestep;
-extern mjtNum state_nominal[kMaxStep][kMaxState];
-extern mjtNum ctrl_nominal[kMaxStep * kMaxState];
-extern mjtNum ctrl_openloop[kMaxStep * kMaxState];
-extern mjtNum rest_length[kMaxStep * kMaxState];
-extern mjtNum delta_rest_length[kMaxStep*kMaxState];
-extern mjtNum state_target[kMaxState];
-extern mjtNum stabilizer_feedback_gain[kMaxState][kMaxState];
+extern AlignedMatrix state_nominal;
+extern mjtNum* ctrl_nominal;
+extern mjtNum* ctrl_openloop;
+extern mjtNum* rest_length;
+extern mjtNum* delta_rest_length;
+extern mjtNum* state_target;
+extern AlignedMatrix stabilizer_feedback_gain;
 extern mjtNum ctrl_upperlimit;
 extern mjtNum ctrl_lowerlimit;
 
 // hyperparameters 
 extern mjtNum Q, QT, R;
-extern mjtNum Qm[kMaxState][kMaxState], QTm[kMaxState][kMaxState];
+extern AlignedMatrix Qm, QTm;
 
 // user data
 mjModel* m = NULL;
@@ -55,7 +55,7 @@ mjtNum ctrl_max = 0;
 mjtNum perturb_coefficient_std = 0;
 mjtNum cost_closedloop = 0, cost_openloop = 0;
 mjtNum energy = 0;
-mjtNum tracker_feedback_gain[kMaxStep][kMaxState][kMaxState] = { 0 };
+AlignedMatrix tracker_feedback_gain;  // stepnum blocks of actuatornum x statedim
 FILE *filestream1, *filestream2;
 char testmode[30];
 char data_buff[30];
@@ -1828,7 +1828,7 @@ void simulateNominal(void)
 	//d->qpos[17] = -d->qpos[7];
 	//d->qpos[23] = -d->qpos[7];
 
-	for (int i = 0; i < integration_per_step; i++) mj_step(m, d);
+	controlStep(m, d);
 	step_index_nominal++;
 }
 
@@ -1867,7 +1867,7 @@ bool simulateClosedloop(void)
 			state_error[21] = state_nominal[step_index_closedloop][21] - d_closedloop->qvel[18];
 			state_error[27] = state_nominal[step_index_closedloop][27] - d_closedloop->qvel[21];
 		}
-		mju_mulMatVec(ctrl_feedback, *tracker_feedback_gain[step_index_closedloop], state_error, kMaxState, kMaxState);
+		mju_mulMatVec(ctrl_feedback, tracker_feedback_gain[step_index_closedloop * actuatornum], state_error, actuatornum, statedim);
 		mju_add(d_closedloop->ctrl, &ctrl_openloop[step_index_closedloop * actuatornum], ctrl_feedback, m->nu);
 		ctrlLimit(d_closedloop->ctrl, m->nu);
 		mju_add(ctrl_temp, &ctrl_nominal[step_index_closedloop * actuatornum], ctrl_feedback, m->nu);
@@ -1875,7 +1875,7 @@ bool simulateClosedloop(void)
 		energy += mju_dot(ctrl_temp, ctrl_temp, m->nu);
 		cost_closedloop += stepCost(m, d_closedloop, step_index_closedloop);
 	}
-	for (int i = 0; i < integration_per_step; i++) mj_step(m, d_closedloop); //printf("%f\t%f\t%f\t%f\t%f\t%f\t%d\n", d->qpos[0], d_closedloop->qpos[0], d->qpos[1],  d_closedloop->qpos[1], d->qpos[2], d_closedloop->qpos[2], terminal_trigger);
+	controlStep(m, d_closedloop); //printf("%f\t%f\t%f\t%f\t%f\t%f\t%d\n", d->qpos[0], d_closedloop->qpos[0], d->qpos[1],  d_closedloop->qpos[1], d->qpos[2], d_closedloop->qpos[2], terminal_trigger);
 	step_index_closedloop++;																		 // process noise including state noise
 	//mju_add(d_closedloop->qpos, d_closedloop->qpos, randGauss(0, 0.00023, dof + quatnum), dof + quatnum);
 	//mju_add(d_closedloop->qvel, d_closedloop->qvel, randGauss(0, 0.00023, dof), dof);
@@ -1904,7 +1904,7 @@ bool simulateOpenloop(void)
 		ctrlLimit(d_openloop->ctrl, m->nu);
 		cost_openloop += stepCost(m, d_openloop, step_index_openloop);
 	}
-	for (int i = 0; i < integration_per_step; i++) mj_step(m, d_openloop);
+	controlStep(m, d_openloop);
 	step_index_openloop++;
 	//printf("%f,%f,%f\n", d_openloop->qpos[0]-state_nominal[step_index_openloop][0], d_openloop->qpos[1]- state_nominal[step_index_openloop][1], d_openloop->qvel[1]- state_nominal[step_index_openloop][9]);
 	return 0;
@@ -1960,12 +1960,12 @@ mjtNum terminalError(mjtNum ptb, const char *type)
 			else {
 				mju_sub(state_error, state_nominal[step_index], d_closedloop->qpos, dof + quatnum);
 				mju_sub(&state_error[dof + quatnum], &state_nominal[step_index][dof + quatnum], d_closedloop->qvel, dof);
-				mju_mulMatVec(ctrl_feedback, *tracker_feedback_gain[step_index], state_error, kMaxState, kMaxState);
+				mju_mulMatVec(ctrl_feedback, tracker_feedback_gain[step_index * actuatornum], state_error, actuatornum, statedim);
 				mju_add(d_closedloop->ctrl, &ctrl_openloop[step_index * actuatornum], ctrl_feedback, m->nu);
 				ctrlLimit(d_closedloop->ctrl, m->nu);
 			}
 		}
-		for (int i = 0; i < integration_per_step; i++) mj_step(m, d_closedloop);
+		controlStep(m, d_closedloop);
 	}
 	if (modelid == 0)
 		return sqrt(angleModify(modelid, d_closedloop->qpos[0])*angleModify(modelid, d_closedloop->qpos[0]) + d_closedloop->qvel[0] * d_closedloop->qvel[0]);
@@ -2311,7 +2311,7 @@ void simulate(void)
     mjtNum simsync = 0;
 
     // run until asked to exit
-	srand((unsigned)time(NULL));
+	randSeed((unsigned)time(NULL), 1);
     while( !settings.exitrequest )
     {
         // sleep for 1 ms or yield, to let main thread run
@@ -2458,33 +2458,9 @@ void simulate(void)
 
 //-------------------------------- init and main ----------------------------------------
 
-// initalize
-void init(void)
+// read nominal trajectory, feedback gains and cost parameters, once the storage is sized
+void loaddata(void)
 {
-	// print version, check compatibility
-	printf("MuJoCo Pro version %.2lf\n", 0.01*mj_version());
-	if (mjVERSION_HEADER != mj_version())
-		mju_error("Headers and library have different versions");
-
-	// activate MuJoCo license
-	DWORD usernamesize = 30;
-	GetUserName(username, &usernamesize);
-	if (username[0] == 'R') {
-		strcpy(keyfilename, keyfilepre);
-		strcat(keyfilename, "mjkeybig.txt");
-		mj_activate(keyfilename);
-	}
-	else if (username[0] == 'r') {
-		strcpy(keyfilename, keyfilepre);
-		strcat(keyfilename, "mjkeyda.txt");
-		mj_activate(keyfilename);
-	}
-    else {
-        strcpy(keyfilename, keyfilepre);
-        strcat(keyfilename, "mjkeysmall.txt");
-        mj_activate(keyfilename);
-    }
-
 	// read nominal control values
 	strcpy(datafilename, "result0.txt");
 	if ((filestream1 = fopen(datafilename, "r")) != NULL)
@@ -2521,7 +2497,7 @@ void init(void)
 			for (int i2 = 0; i2 < actuatornum; i2++) {
 				for (int i = 0; i < 2*dof+quatnum; i++) {
 					fscanf(filestream1, "%s", data_buff);
-					tracker_feedback_gain[i1][i2][i] = atof(data_buff);
+					tracker_feedback_gain[i1 * actuatornum + i2][i] = atof(data_buff);
 				}
 			}
 		}
@@ -2571,6 +2547,34 @@ void init(void)
 		fclose(filestream1);
 	}
 	else printf("Could not open file: parameters.txt\n");
+}
+
+// initalize
+void init(void)
+{
+	// print version, check compatibility
+	printf("MuJoCo Pro version %.2lf\n", 0.01*mj_version());
+	if (mjVERSION_HEADER != mj_version())
+		mju_error("Headers and library have different versions");
+
+	// activate MuJoCo license
+	DWORD usernamesize = 30;
+	GetUserName(username, &usernamesize);
+	if (username[0] == 'R') {
+		strcpy(keyfilename, keyfilepre);
+		strcat(keyfilename, "mjkeybig.txt");
+		mj_activate(keyfilename);
+	}
+	else if (username[0] == 'r') {
+		strcpy(keyfilename, keyfilepre);
+		strcat(keyfilename, "mjkeyda.txt");
+		mj_activate(keyfilename);
+	}
+    else {
+        strcpy(keyfilename, keyfilepre);
+        strcat(keyfilename, "mjkeysmall.txt");
+        mj_activate(keyfilename);
+    }
 
 	// init GLFW, set timer callback (milliseconds)
 	if (!glfwInit())
@@ -2692,11 +2696,21 @@ int main(int argc, const char** argv)
 		printf("Invalid stepnum argument");
 		return 0;
 	}
-	srand((unsigned)time(NULL));
+	randSeed((unsigned)time(NULL));
 
 	// initialize
 	init();
 	loadmodel();
+	if (modelDimension(m) != 1) {
+		printf("Unknown model or model dimension over kMaxState");
+		return 0;
+	}
+	matrixResize(&tracker_feedback_gain, stepnum * actuatornum, statedim);
+	if (!tracker_feedback_gain.data) {
+		printf("Could not allocate the feedback gains");
+		return 0;
+	}
+	loaddata();
 
 	// check timestep setting
 	simulation_timestep = m->opt.timestep;
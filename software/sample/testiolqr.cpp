@@ -23,7 +23,6 @@ struct MatData {
 };
 
 // constants
-extern const int kMaxStep = 3000;   // max step number for one rollout
 extern const int kMaxState = 160;	// max (state dimension, actuator number)
 
 const int kTestNum = 400;	        // number of monte-carlo runs
@@ -37,21 +36,22 @@ extern int stepnum;
 extern int actuatornum;
 extern int quatnum;
 extern int dof;
+extern int statedim;
 extern int nodenum;
 extern int modelid;
 extern mjtNum control_timestep;
 extern mjtNum simulation_timestep;
-extern mjtNum state_nominal[kMaxStep][kMaxState];
-extern mjtNum ctrl_nominal[kMaxStep * kMaxState];
-extern mjtNum ctrl_openloop[kMaxStep * kMaxState];
-extern mjtNum state_target[kMaxState];
-extern mjtNum stabilizer_feedback_gain[kMaxState][kMaxState];
+extern AlignedMatrix state_nominal;
+extern mjtNum* ctrl_nominal;
+extern mjtNum* ctrl_openloop;
+extern mjtNum* state_target;
+extern AlignedMatrix stabilizer_feedback_gain;
 extern mjtNum ctrl_upperlimit;
 extern mjtNum ctrl_lowerlimit;
 
 // hyperparameters 
 extern mjtNum Q, QT, R;
-extern mjtNum Qm[kMaxState][kMaxState], QTm[kMaxState][kMaxState];
+extern AlignedMatrix Qm, QTm;
 
 // user data
 mjModel* m = NULL;
@@ -62,7 +62,7 @@ mjtNum ctrl_max = 0;
 mjtNum perturb_coefficient_test = 0;
 mjtNum cost_closedloop = 0, cost_openloop = 0;
 mjtNum energy = 0;
-mjtNum tracker_feedback_gain[kMaxStep][kMaxState][kMaxState] = { 0 };
+AlignedMatrix tracker_feedback_gain;  // stepnum blocks of actuatornum x statedim
 FILE *filestream1, *filestream2;
 MatData MTK, MCK, MQ, MQU;
 char testmode[30];
@@ -1836,8 +1836,7 @@ void simulateNominal(void)
 	}
 	else mju_copy(d->ctrl, &ctrl_nominal[step_index_nominal * actuatornum], m->nu);
 	ctrlLimit(d->ctrl, m->nu);//for (int i = 0; i < m->nq; i++) printf(" d->qpos[%d]        : %.8f\n", i, d->qpos[i]);
-	for (int i = 0; i < integration_per_step; i++) mj_step(m, d);
-	mj_forward(m, d);
+	controlStep(m, d);
 	step_index_nominal++;
 }
 
@@ -1896,8 +1895,7 @@ bool simulateClosedloop(void)
 		energy += mju_dot(ctrl_temp, ctrl_temp, m->nu);
 		cost_closedloop += stepCost(m, d_closedloop, step_index_closedloop);
 	}
-	for (int i = 0; i < integration_per_step; i++) mj_step(m, d_closedloop);
-	mj_forward(m, d_closedloop);
+	controlStep(m, d_closedloop);
 	step_index_closedloop++;
 	// process noise including state noise
 	//mju_add(d_closedloop->qpos, d_closedloop->qpos, randGauss(0, 0.00023, dof + quatnum), dof + quatnum);
@@ -1939,8 +1937,7 @@ bool simulateOpenloop(void)
 		ctrlLimit(d_openloop->ctrl, m->nu);
 		cost_openloop += stepCost(m, d_openloop, step_index_openloop);
 	}
-	for (int i = 0; i < integration_per_step; i++) mj_step(m, d_openloop);
-	mj_forward(m, d_openloop);
+	controlStep(m, d_openloop);
 	step_index_openloop++;
 	return 0;
 }
@@ -1959,11 +1956,10 @@ mjtNum terminalError(mjtNum ptb, const char *type)
 		else {
 			mju_sub(state_error, state_nominal[step_index], d_closedloop->qpos, dof + quatnum);
 			mju_sub(&state_error[dof + quatnum], &state_nominal[step_index][dof + quatnum], d_closedloop->qvel, dof);
-			mju_mulMatVec(ctrl_feedback, *tracker_feedback_gain[step_index], state_error, kMaxState, kMaxState);
+			mju_mulMatVec(ctrl_feedback, tracker_feedback_gain[step_index * actuatornum], state_error, actuatornum, statedim);
 			mju_add(d_closedloop->ctrl, &ctrl_openloop[step_index * actuatornum], ctrl_feedback, m->nu);
 		}
-		for (int i = 0; i < integration_per_step; i++) mj_step(m, d_closedloop);
-		mj_forward(m, d_closedloop);
+		controlStep(m, d_closedloop);
 	}
 	if (modelid == 0)
 		return sqrt(angleModify(modelid, d_closedloop->qpos[0])*angleModify(modelid, d_closedloop->qpos[0]) + d_closedloop->qvel[0] * d_closedloop->qvel[0]);
@@ -2315,7 +2311,7 @@ void simulate(void)
     mjtNum simsync = 0;
 
     // run until asked to exit
-	srand((unsigned)time(NULL));
+	randSeed((unsigned)time(NULL), 1);
     while( !settings.exitrequest )
     {
         // sleep for 1 ms or yield, to let main thread run
@@ -2448,33 +2444,9 @@ void simulate(void)
 
 //-------------------------------- init and main ----------------------------------------
 
-// initalize
-void init(void)
+// read nominal trajectory, feedback gains and cost parameters, once the storage is sized
+void loaddata(void)
 {
-	// print version, check compatibility
-	printf("MuJoCo Pro version %.2lf\n", 0.01*mj_version());
-	if (mjVERSION_HEADER != mj_version())
-		mju_error("Headers and library have different versions");
-
-	// activate MuJoCo license
-	DWORD usernamesize = 30;
-	GetUserName(username, &usernamesize);
-    if (username[0] == 'R') {
-        strcpy(keyfilename, keyfilepre);
-        strcat(keyfilename, "mjkeybig.txt");
-        mj_activate(keyfilename);
-    }
-    else if (username[0] == 'r') {
-        strcpy(keyfilename, keyfilepre);
-        strcat(keyfilename, "mjkeyda.txt");
-        mj_activate(keyfilename);
-    }
-    else {
-        strcpy(keyfilename, keyfilepre);
-        strcat(keyfilename, "mjkeysmall.txt");
-        mj_activate(keyfilename);
-    }
-
 	// read nominal control values
 	strcpy(datafilename, "result0.txt");
 	if ((filestream1 = fopen(datafilename, "r")) != NULL)
@@ -2497,7 +2469,7 @@ void init(void)
 			for (int i2 = 0; i2 < actuatornum; i2++) {
 				for (int i = 0; i < 2*dof+quatnum; i++) {
 					fscanf(filestream1, "%s", data_buff);
-					tracker_feedback_gain[i1][i2][i] = atof(data_buff);
+					tracker_feedback_gain[i1 * actuatornum + i2][i] = atof(data_buff);
 				}
 			}
 		}
@@ -2558,6 +2530,34 @@ void init(void)
 	mqu = MQU.data[0];
 
 	if (!(2 * dof + quatnum == MCK.dimension[1] || 2 * 3 * nodenum == MCK.dimension[1])) printf("Wrong dimension for matrix Ck\n");
+}
+
+// initalize
+void init(void)
+{
+	// print version, check compatibility
+	printf("MuJoCo Pro version %.2lf\n", 0.01*mj_version());
+	if (mjVERSION_HEADER != mj_version())
+		mju_error("Headers and library have different versions");
+
+	// activate MuJoCo license
+	DWORD usernamesize = 30;
+	GetUserName(username, &usernamesize);
+    if (username[0] == 'R') {
+        strcpy(keyfilename, keyfilepre);
+        strcat(keyfilename, "mjkeybig.txt");
+        mj_activate(keyfilename);
+    }
+    else if (username[0] == 'r') {
+        strcpy(keyfilename, keyfilepre);
+        strcat(keyfilename, "mjkeyda.txt");
+        mj_activate(keyfilename);
+    }
+    else {
+        strcpy(keyfilename, keyfilepre);
+        strcat(keyfilename, "mjkeysmall.txt");
+        mj_activate(keyfilename);
+    }
 
 	// init GLFW, set timer callback (milliseconds)
 	if (!glfwInit())
@@ -2679,11 +2679,21 @@ int main(int argc, const char** argv)
 		printf("Invalid stepnum argument");
 		return 0;
 	}
-	srand((unsigned)time(NULL));
+	randSeed((unsigned)time(NULL));
 
 	// initialize
 	init();
 	loadmodel();
+	if (modelDimension(m) != 1) {
+		printf("Unknown model or model dimension over kMaxState");
+		return 0;
+	}
+	matrixResize(&tracker_feedback_gain, stepnum * actuatornum, statedim);
+	if (!tracker_feedback_gain.data) {
+		printf("Could not allocate the feedback gains");
+		return 0;
+	}
+	loaddata();
 
 	// check timestep setting
 	simulation_timestep = m->opt.timestep;